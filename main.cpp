@@ -1,13 +1,56 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <stack>
 #include <string>
 #include <functional>
 #include <exception>
+#include <stdexcept>
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <memory_resource>
+#include <span>
+#include <mutex>
 #include <unordered_map>
+#include <thread>
+#include <utility>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 #include <list>
 #include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <chrono>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#ifdef __unix__
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/resource.h>
+#include <ucontext.h>
+#endif
 
 using Lazy = std::function<int(void)>;
+using Operator = std::function<int(Lazy, Lazy)>;
 
 class SyntaxError : public std::exception {
     const char *what() const noexcept { return "Expression has uncorrect syntax\n"; }
@@ -17,63 +60,3374 @@ class OperatorAlreadyDefined : public std::exception {
     const char *what() const noexcept { return "This operator is already defined\n"; }
 };
 
-class UnknownOperator : public std::exception {
-    const char *what() const noexcept { return "This operator is not defined\n"; }
-};
+class UnknownOperator : public std::exception {
+    const char *what() const noexcept { return "This operator is not defined\n"; }
+};
+
+// Move-only nullary thunk with an inline buffer. Closures of up to capacity
+// bytes, which includes every closure the calculator itself creates, are
+// stored without touching the heap; larger ones fall back to it. Converts
+// from and to Lazy at API boundaries.
+class InlineLazy {
+public:
+    static constexpr std::size_t capacity = 32;
+
+    template<typename F>
+    static constexpr bool storedInline = sizeof(F) <= capacity
+                                         && alignof(F) <= alignof(std::max_align_t)
+                                         && std::is_nothrow_move_constructible<F>::value;
+
+    InlineLazy() = default;
+
+    template<typename F>
+        requires (!std::is_same_v<std::decay_t<F>, InlineLazy> && std::is_invocable_r_v<int, std::decay_t<F> &>)
+    InlineLazy(F &&fn) {
+        using Stored = std::decay_t<F>;
+        if constexpr (storedInline<Stored>) {
+            new(storage) Stored(std::forward<F>(fn));
+            operations = &inlineOperations<Stored>;
+        } else {
+            *reinterpret_cast<Stored **>(storage) = new Stored(std::forward<F>(fn));
+            operations = &heapOperations<Stored>;
+        }
+    }
+
+    InlineLazy(InlineLazy &&other) noexcept : operations(other.operations) {
+        if (operations != nullptr) {
+            operations->move(other.storage, storage);
+            other.operations = nullptr;
+        }
+    }
+
+    InlineLazy &operator=(InlineLazy &&other) noexcept {
+        if (this != &other) {
+            reset();
+            operations = other.operations;
+            if (operations != nullptr) {
+                operations->move(other.storage, storage);
+                other.operations = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    InlineLazy(const InlineLazy &) = delete;
+    InlineLazy &operator=(const InlineLazy &) = delete;
+
+    ~InlineLazy() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return operations != nullptr;
+    }
+
+    int operator()() const {
+        if (operations == nullptr) {
+            throw std::bad_function_call();
+        }
+        return operations->call(storage);
+    }
+
+    // std::function needs a copyable target, so the thunk moves to the heap.
+    operator Lazy() && {
+        if (operations == nullptr) {
+            return Lazy();
+        }
+        auto shared = std::make_shared<InlineLazy>(std::move(*this));
+        return [shared]() { return (*shared)(); };
+    }
+
+private:
+    struct Operations {
+        int (*call)(const void *);
+        void (*move)(void *from, void *to) noexcept;
+        void (*destroy)(void *) noexcept;
+    };
+
+    template<typename F>
+    static constexpr Operations inlineOperations{
+            [](const void *p) { return (*static_cast<F *>(const_cast<void *>(p)))(); },
+            [](void *from, void *to) noexcept {
+                new(to) F(std::move(*static_cast<F *>(from)));
+                static_cast<F *>(from)->~F();
+            },
+            [](void *p) noexcept { static_cast<F *>(p)->~F(); }};
+
+    template<typename F>
+    static constexpr Operations heapOperations{
+            [](const void *p) { return (**static_cast<F *const *>(p))(); },
+            [](void *from, void *to) noexcept { *static_cast<F **>(to) = *static_cast<F **>(from); },
+            [](void *p) noexcept { delete *static_cast<F **>(p); }};
+
+    void reset() {
+        if (operations != nullptr) {
+            operations->destroy(storage);
+            operations = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) mutable unsigned char storage[capacity];
+    const Operations *operations = nullptr;
+};
+
+// The calculator's closures hold a shared plan and at most one pointer.
+static_assert(InlineLazy::capacity >= sizeof(std::shared_ptr<void>) + sizeof(void *),
+              "calculator closures fit inline");
+
+class UnboundInput : public std::exception {
+    const char *what() const noexcept { return "Expression reads an input that was not given a value\n"; }
+};
+
+class CapacityExceeded : public std::exception {
+    const char *what() const noexcept { return "Expression exceeds the configured capacity\n"; }
+};
+
+// Outcome of a calculation reported without throwing, one value per exception above.
+enum class CalculationStatus {
+    Ok,
+    SyntaxError,
+    UnknownOperator,
+    UnboundInput,
+    CapacityExceeded
+};
+
+inline void throwIfFailed(CalculationStatus status) {
+    switch (status) {
+        case CalculationStatus::Ok: return;
+        case CalculationStatus::SyntaxError: throw SyntaxError();
+        case CalculationStatus::UnknownOperator: throw UnknownOperator();
+        case CalculationStatus::UnboundInput: throw UnboundInput();
+        case CalculationStatus::CapacityExceeded: throw CapacityExceeded();
+    }
+}
+
+// Properties an operator promises about itself, which the calculator may rely on.
+enum class OperatorFlags : unsigned {
+    None = 0,
+    // No side effects; the result depends only on the operand values.
+    Pure = 1u << 0,
+    // Evaluates both operands exactly once, left before right, before doing anything else.
+    Strict = 1u << 1,
+    // Operands are call-by-need: each is evaluated on its first use and the
+    // result is reused afterwards. Without it every call re-evaluates.
+    CallByNeed = 1u << 2,
+    // (a op b) op c == a op (b op c). Chains of a pure strict associative
+    // operator are flattened into one node.
+    Associative = 1u << 3,
+    // a op b == b op a.
+    Commutative = 1u << 4,
+    // Evaluates a for its effects only, then returns b. The operator is never
+    // called; chains of it become one node whose operands run in order.
+    Sequencing = 1u << 5,
+    // Never calls a, or b. The parser drops the subtree and passes a thunk
+    // returning 0 instead.
+    IgnoresLeft = 1u << 6,
+    IgnoresRight = 1u << 7
+};
+
+inline OperatorFlags operator|(OperatorFlags a, OperatorFlags b) {
+    return static_cast<OperatorFlags>(static_cast<unsigned>(a) | static_cast<unsigned>(b));
+}
+
+inline bool hasFlags(OperatorFlags set, OperatorFlags flags) {
+    return (static_cast<unsigned>(set) & static_cast<unsigned>(flags)) == static_cast<unsigned>(flags);
+}
+
+// The only literals are the digits 0, 2 and 4.
+constexpr bool isLiteral(char c) {
+    return c == '0' || c == '2' || c == '4';
+}
+
+struct OperatorDefinition {
+    char symbol;
+    Operator fn;
+    OperatorFlags flags = OperatorFlags::None;
+};
+
+// Operators indexed directly by their character, along with the characters
+// reserved as input slots. Entries are shared, so copying the table for
+// copy-on-write only copies pointers.
+class OperatorTable {
+private:
+    std::array<std::shared_ptr<const OperatorDefinition>, 256> operators;
+    std::array<std::int16_t, 256> inputs;
+    std::size_t inputCount = 0;
+
+public:
+    OperatorTable() {
+        inputs.fill(-1);
+    }
+
+    const OperatorDefinition *find(char c) const {
+        return operators[static_cast<unsigned char>(c)].get();
+    }
+
+    // Slot of an input character, or -1 when c is not an input.
+    int inputSlot(char c) const {
+        return inputs[static_cast<unsigned char>(c)];
+    }
+
+    std::size_t inputSlots() const {
+        return inputCount;
+    }
+
+    bool defined(char c) const {
+        return find(c) != nullptr || inputSlot(c) >= 0;
+    }
+
+    int insertInput(char c) {
+        inputs[static_cast<unsigned char>(c)] = static_cast<std::int16_t>(inputCount);
+        return static_cast<int>(inputCount++);
+    }
+
+    void insert(OperatorDefinition definition) {
+        auto c = static_cast<unsigned char>(definition.symbol);
+        operators[c] = std::make_shared<const OperatorDefinition>(std::move(definition));
+    }
+};
+
+// Applies a strict operator to operands that were already evaluated. The
+// built-in arithmetic, which cannot be redefined, skips its std::function.
+inline int applyStrict(const OperatorDefinition &op, int a, int b) {
+    switch (op.symbol) {
+        case '+': return a + b;
+        case '-': return a - b;
+        case '*': return a * b;
+        case '/': return a / b;
+        default: return op.fn([a]() { return a; }, [b]() { return b; });
+    }
+}
+
+#if defined(__linux__) && defined(__GLIBC__)
+#define LAZY_CALCULATOR_STACK_SEGMENTS 1
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#define LAZY_CALCULATOR_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define LAZY_CALCULATOR_ASAN 1
+#endif
+#endif
+#if defined(__SANITIZE_THREAD__)
+#define LAZY_CALCULATOR_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define LAZY_CALCULATOR_TSAN 1
+#endif
+#endif
+#if defined(LAZY_CALCULATOR_STACK_SEGMENTS) && defined(LAZY_CALCULATOR_ASAN)
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+// Operators that are not strict evaluate their operands from their own
+// code, so each level of a chain of them nests native calls. Those calls go
+// through run(), which continues on a fresh stack segment mapped from the
+// heap whenever the current one runs low. Depth is then bounded by memory
+// instead of the thread's stack; elsewhere it still is bounded by the latter.
+class NativeStack {
+public:
+    template<typename F>
+    static int run(F &fn) {
+#ifdef LAZY_CALCULATOR_STACK_SEGMENTS
+        char probe;
+        if (&probe < limit(&probe)) {
+            return onSegment(fn);
+        }
+#endif
+        return fn();
+    }
+
+    // Looks up where the calling thread's stack ends. The C library allocates
+    // for that and, on the main thread, reads /proc/self/maps, so it is done
+    // ahead of evaluation: by pool workers as they start and by calculators
+    // on the thread that creates them. Other threads do it on their first
+    // operator call. Only if the lookup fails do they assume a quarter of
+    // RLIMIT_STACK, at most fallbackBudget, below that call.
+    static void prepare() {
+#ifdef LAZY_CALCULATOR_STACK_SEGMENTS
+        if (low != nullptr) {
+            return;
+        }
+        pthread_attr_t attributes;
+        void *stack;
+        std::size_t size;
+        if (::pthread_getattr_np(::pthread_self(), &attributes) == 0) {
+            ::pthread_attr_getstack(&attributes, &stack, &size);
+            ::pthread_attr_destroy(&attributes);
+            low = static_cast<char *>(stack) + reserve;
+        }
+#endif
+    }
+
+#ifdef LAZY_CALCULATOR_STACK_SEGMENTS
+private:
+    static constexpr std::size_t segmentSize = std::size_t(1) << 22;
+    // Left free below the limit for operator code, which runs unchecked.
+    static constexpr std::size_t reserve = std::size_t(1) << 18;
+    static constexpr std::size_t fallbackBudget = std::size_t(1) << 20;
+
+    struct Transfer {
+        void *fn;
+        int (*call)(void *);
+        int result;
+        std::exception_ptr error;
+        ucontext_t caller;
+        ucontext_t callee;
+        // What AddressSanitizer needs to follow the switches.
+        void *fakeStack;
+        const void *callerBottom;
+        std::size_t callerSize;
+    };
+
+    static void startSwitch(void **fakeStack, const void *bottom, std::size_t size) {
+#ifdef LAZY_CALCULATOR_ASAN
+        __sanitizer_start_switch_fiber(fakeStack, bottom, size);
+#else
+        (void) fakeStack, (void) bottom, (void) size;
+#endif
+    }
+
+    static void finishSwitch(void *fakeStack, const void **bottom, std::size_t *size) {
+#ifdef LAZY_CALCULATOR_ASAN
+        __sanitizer_finish_switch_fiber(fakeStack, bottom, size);
+#else
+        (void) fakeStack, (void) bottom, (void) size;
+#endif
+    }
+
+    // Mapped with an inaccessible lowest page, so overflowing it faults.
+    struct Segment {
+        char *base;
+
+        Segment() {
+            void *mapped = ::mmap(nullptr, segmentSize, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+            if (mapped == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            base = static_cast<char *>(mapped);
+            ::mprotect(base, static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)), PROT_NONE);
+        }
+
+        Segment(const Segment &) = delete;
+        Segment &operator=(const Segment &) = delete;
+
+        ~Segment() {
+            ::munmap(base, segmentSize);
+        }
+    };
+
+    // Lowest address calls may nest down to on the current stack.
+    static inline thread_local char *low = nullptr;
+    static inline thread_local Transfer *starting = nullptr;
+    // Last segment released, kept so an operator that keeps calling across
+    // the limit does not map and unmap one on every call.
+    static inline thread_local std::unique_ptr<Segment> spare;
+
+    static char *limit(char *probe) {
+        if (low == nullptr) {
+            prepare();
+        }
+        if (low == nullptr) {
+            std::size_t budget = fallbackBudget;
+            rlimit stack;
+            if (::getrlimit(RLIMIT_STACK, &stack) == 0 && stack.rlim_cur != RLIM_INFINITY) {
+                budget = std::min<std::size_t>(budget, stack.rlim_cur / 4);
+            }
+            low = reinterpret_cast<char *>(reinterpret_cast<std::uintptr_t>(probe) - budget);
+        }
+        return low;
+    }
+
+    static void entry() {
+        Transfer *transfer = starting;
+        finishSwitch(nullptr, &transfer->callerBottom, &transfer->callerSize);
+        try {
+            transfer->result = transfer->call(transfer->fn);
+        }
+        catch (...) {
+            transfer->error = std::current_exception();
+        }
+        startSwitch(nullptr, transfer->callerBottom, transfer->callerSize);
+    }
+
+    template<typename F>
+    static int onSegment(F &fn) {
+        std::unique_ptr<Segment> segment = spare ? std::move(spare) : std::make_unique<Segment>();
+        Transfer transfer{&fn, [](void *f) { return (*static_cast<F *>(f))(); }, 0, nullptr, {}, {},
+                          nullptr, nullptr, 0};
+        ::getcontext(&transfer.callee);
+        transfer.callee.uc_stack.ss_sp = segment->base;
+        transfer.callee.uc_stack.ss_size = segmentSize;
+        transfer.callee.uc_link = &transfer.caller;
+        ::makecontext(&transfer.callee, entry, 0);
+        char *outer = low;
+        low = segment->base + reserve;
+        starting = &transfer;
+        startSwitch(&transfer.fakeStack, segment->base, segmentSize);
+        ::swapcontext(&transfer.caller, &transfer.callee);
+        finishSwitch(transfer.fakeStack, nullptr, nullptr);
+        low = outer;
+        if (!spare) {
+            spare = std::move(segment);
+        }
+        if (transfer.error) {
+            std::rethrow_exception(transfer.error);
+        }
+        return transfer.result;
+    }
+#endif
+};
+
+// Operands an evaluator hands to the operators it calls. Program
+// continues the evaluation that made a call with resume(State &, Entry), and
+// runs an operand afresh with restart(Entry, inputs, resource) once that is
+// over.
+// State keeps the scope its calls share and ends it with close().
+template<typename Program, typename State, typename Entry>
+class OperandLinks {
+public:
+    // What operands kept by an operator need once their evaluation is over:
+    // they then run on a fresh one, with a copy of the inputs.
+    struct Scope {
+        std::shared_ptr<const Program> owner; // Empty when the program is not shared.
+        const Program *program;
+        State *state; // Null once the evaluation has ended.
+        std::pmr::vector<int> inputs; // From the resource the scope came from.
+        bool bound;
+    };
+
+    // Calls op with operands left and right. Operands owned by the thunks
+    // share scope, created by the first such call, and come from resource
+    // like it. Without a resource they live on this frame and must not be
+    // kept past the call. Only real-time evaluation asks for those, and its
+    // depth limit bounds the nesting, so they stay on the thread's stack.
+    static int call(const OperatorDefinition &op, const Program &program, State &state,
+                    std::shared_ptr<Scope> &scope, Entry left, Entry right, bool byNeed,
+                    std::pmr::memory_resource *resource) {
+        Operands operands{&state, nullptr, {left, right}, byNeed, {false, false}, {0, 0}};
+        if (resource == nullptr) {
+            return op.fn([&operands]() { return evaluate(operands, 0); },
+                         [&operands]() { return evaluate(operands, 1); });
+        }
+        if (!scope) {
+            scope = std::allocate_shared<Scope>(std::pmr::polymorphic_allocator<Scope>(resource),
+                                                Scope{program.weak_from_this().lock(), &program, &state,
+                                                      std::pmr::vector<int>(resource), false});
+        }
+        operands.scope = scope;
+        auto shared = std::allocate_shared<Operands>(std::pmr::polymorphic_allocator<Operands>(resource),
+                                                     std::move(operands));
+        auto apply = [&op, &shared]() {
+            return op.fn([shared]() { return evaluate(*shared, 0); },
+                         [shared]() { return evaluate(*shared, 1); });
+        };
+        return NativeStack::run(apply);
+    }
+
+    // Called as the evaluation ends. Operands still kept keep its inputs.
+    static void close(const std::shared_ptr<Scope> &scope, const int *inputs, std::size_t count) {
+        if (scope) {
+            if (scope.use_count() > 1 && inputs != nullptr) {
+                scope->inputs.assign(inputs, inputs + count);
+                scope->bound = true;
+            }
+            scope->state = nullptr;
+        }
+    }
+
+private:
+    // Both operands of one operator call. On the evaluating frame, or shared
+    // by the thunks when they own what they need.
+    struct Operands {
+        State *state;
+        std::shared_ptr<Scope> scope;
+        Entry entries[2];
+        bool byNeed;
+        bool known[2];
+        int values[2];
+    };
+
+    static int evaluate(Operands &operands, int side) {
+        if (operands.known[side]) {
+            return operands.values[side];
+        }
+        State *state = operands.scope ? operands.scope->state : operands.state;
+        int value;
+        if (state != nullptr) {
+            value = Program::resume(*state, operands.entries[side]);
+        } else {
+            const Scope &scope = *operands.scope;
+            value = scope.program->restart(operands.entries[side], scope.bound ? scope.inputs.data() : nullptr,
+                                           scope.inputs.get_allocator().resource());
+        }
+        if (operands.byNeed) {
+            operands.values[side] = value;
+            operands.known[side] = true;
+        }
+        return value;
+    }
+};
+
+// Parsed expression stored as one contiguous buffer of nodes. Children are
+// referenced by 32-bit indices into that buffer, so building a plan costs a
+// handful of allocations regardless of the expression length. Identical
+// subtrees are stored once, which makes the plan a DAG rather than a tree.
+class ExpressionPlan : public std::enable_shared_from_this<ExpressionPlan> {
+public:
+    using Index = std::uint32_t;
+
+    enum class NodeKind : std::uint8_t {
+        Literal,
+        Input,
+        Call,
+        Reduce,  // Operands operands[left] to operands[left + right - 1], folded left to right.
+        Sequence // Same operands, evaluated in order; the last one is the result.
+    };
+
+    enum NodeFlags : std::uint8_t {
+        PureNode = 1u << 0,     // Built only from literals, inputs and pure operators.
+        MemoizedNode = 1u << 1  // Pure and shared, evaluated at most once per call.
+    };
+
+    struct Node {
+        NodeKind kind;
+        char symbol;
+        std::uint8_t flags;
+        std::int32_t value; // Literal: its value, Input: its slot, Call and Reduce: slot in operatorSlots.
+        Index left;
+        Index right;
+    };
+
+    // Nodes are allocated from the resource, which must outlive the plan.
+    explicit ExpressionPlan(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+            : operatorSlots(resource), nodes(resource), operands(resource) {}
+
+    // Reads inputs[slot] for every input; without inputs they are unbound.
+    // Operators may keep their operands and call them after evaluate returns.
+    int evaluate(const int *inputs = nullptr) const {
+        return evaluateNode(root, inputs);
+    }
+
+    // Takes the evaluation stacks, and whatever operands kept by operators
+    // need, from scratch instead of the default resource. Kept operands run
+    // on scratch too, so it must outlive them.
+    int evaluate(const int *inputs, std::pmr::memory_resource *scratch) const {
+        return evaluateNode(root, inputs, scratch);
+    }
+
+    // Nodes on the longest path from the root.
+    std::size_t depth() const {
+        return rootDepth;
+    }
+
+    std::size_t size() const {
+        return nodes.size();
+    }
+
+    // Number of values evaluate() reads from its inputs array.
+    std::size_t inputSlots() const {
+        return inputCount;
+    }
+
+private:
+    friend class PlanBuilder;
+    friend class BytecodeCompiler;
+    friend class ColumnarExpression;
+    friend class NativeExpression;
+    friend class RealTimeCalculator;
+    friend class PreparedExpression;
+
+    template<typename F>
+    void forEachChild(const Node &node, F f) const {
+        if (node.kind == NodeKind::Call) {
+            f(node.left);
+            f(node.right);
+        } else if (node.kind == NodeKind::Reduce || node.kind == NodeKind::Sequence) {
+            for (Index k = node.left; k < node.left + node.right; k++) {
+                f(operands[k]);
+            }
+        }
+    }
+
+    std::size_t longestPath(std::pmr::memory_resource *scratch) const {
+        std::pmr::vector<Index> depths(nodes.size(), 1, scratch);
+        for (Index i = 0; i < nodes.size(); i++) {
+            forEachChild(nodes[i], [&depths, i](Index child) {
+                depths[i] = std::max<Index>(depths[i], depths[child] + 1);
+            });
+        }
+        return depths[root];
+    }
+
+    // Operands handed to operators own what they need, allocated from scratch,
+    // unless operandsOwned is false. The stacks are reserved once for the
+    // plan's depth and never grow; for shallow plans they fit on this frame.
+    int evaluateNode(Index node, const int *inputs,
+                     std::pmr::memory_resource *scratch = std::pmr::get_default_resource(),
+                     bool operandsOwned = true) const {
+        Evaluation evaluation(this, inputs, scratch);
+        evaluation.operandsOwned = operandsOwned;
+        // Every level holds at most an expanded frame, a pending sibling and one value.
+        evaluation.frames.reserve(2 * rootDepth + 1);
+        evaluation.values.reserve(rootDepth + 1);
+        if (memoized) {
+            evaluation.memo.resize(nodes.size());
+            evaluation.known.resize(nodes.size());
+        }
+        return evaluate(evaluation, node);
+    }
+
+    struct Frame {
+        Index node;
+        Index step; // Operands of a strict node evaluated so far.
+    };
+
+    struct Evaluation;
+    using Operands = OperandLinks<ExpressionPlan, Evaluation, Index>;
+    friend Operands;
+
+    static constexpr std::size_t inlineStackBytes = 512;
+
+    // Continuation and value stacks live off the native stack and are shared
+    // by every nested evaluation of one call, so depth never grows the
+    // latter. They take inlineStackBytes here when that is enough, scratch
+    // otherwise.
+    struct Evaluation {
+        Evaluation(const ExpressionPlan *plan, const int *inputs, std::pmr::memory_resource *scratch)
+                : plan(plan), inputs(inputs), scratch(scratch),
+                  inlineStacks(inlineStack, sizeof(inlineStack), scratch),
+                  frames(stacksResource(plan)), values(stacksResource(plan)), memo(scratch), known(scratch) {}
+
+        Evaluation(const Evaluation &) = delete;
+        Evaluation &operator=(const Evaluation &) = delete;
+
+        ~Evaluation() {
+            Operands::close(scope, inputs, plan->inputCount);
+        }
+
+        std::pmr::memory_resource *stacksResource(const ExpressionPlan *plan) {
+            std::size_t depth = plan->rootDepth;
+            bool fits = (2 * depth + 1) * sizeof(Frame) + (depth + 1) * sizeof(int) <= sizeof(inlineStack);
+            return fits ? static_cast<std::pmr::memory_resource *>(&inlineStacks) : scratch;
+        }
+
+        const ExpressionPlan *plan;
+        const int *inputs;
+        std::pmr::memory_resource *scratch;
+        alignas(Frame) std::byte inlineStack[inlineStackBytes];
+        std::pmr::monotonic_buffer_resource inlineStacks;
+        std::pmr::vector<Frame> frames;
+        std::pmr::vector<int> values;
+        std::pmr::vector<int> memo;
+        std::pmr::vector<bool> known;
+        bool operandsOwned = false;
+        std::shared_ptr<Operands::Scope> scope; // Created by the first call that hands out owned operands.
+    };
+
+    static int resume(Evaluation &evaluation, Index node) {
+        return evaluation.plan->evaluate(evaluation, node);
+    }
+
+    int restart(Index node, const int *inputs, std::pmr::memory_resource *resource) const {
+        return evaluateNode(node, inputs, resource);
+    }
+
+    int call(Evaluation &evaluation, const Node &node) const {
+        const OperatorDefinition &op = *operatorSlots[node.value];
+        std::size_t frames = evaluation.frames.size();
+        std::size_t values = evaluation.values.size();
+        int result = Operands::call(op, *this, evaluation, evaluation.scope, node.left, node.right,
+                                    hasFlags(op.flags, OperatorFlags::CallByNeed),
+                                    evaluation.operandsOwned ? evaluation.scratch : nullptr);
+        // An operator may swallow an exception thrown halfway through an operand.
+        evaluation.frames.resize(frames);
+        evaluation.values.resize(values);
+        return result;
+    }
+
+    // Strict operators have their operands evaluated by this loop; only
+    // operators that decide for themselves re-enter it through a thunk.
+    int evaluate(Evaluation &evaluation, Index root) const {
+        std::pmr::vector<Frame> &frames = evaluation.frames;
+        std::pmr::vector<int> &values = evaluation.values;
+        std::size_t base = frames.size();
+        frames.push_back({root, 0});
+        while (frames.size() > base) {
+            Frame frame = frames.back();
+            frames.pop_back();
+            const Node &node = nodes[frame.node];
+            if (node.kind == NodeKind::Literal) {
+                values.push_back(node.value);
+                continue;
+            }
+            if (node.kind == NodeKind::Input) {
+                if (evaluation.inputs == nullptr) {
+                    throw UnboundInput();
+                }
+                values.push_back(evaluation.inputs[node.value]);
+                continue;
+            }
+            bool memoizedNode = (node.flags & MemoizedNode) != 0;
+            if (memoizedNode && evaluation.known[frame.node]) {
+                values.push_back(evaluation.memo[frame.node]);
+                continue;
+            }
+            const OperatorDefinition &op = *operatorSlots[node.value];
+            int result;
+            if (node.kind == NodeKind::Sequence) {
+                if (frame.step < node.right) {
+                    if (frame.step > 0) {
+                        values.pop_back();
+                    }
+                    frames.push_back({frame.node, frame.step + 1});
+                    frames.push_back({operands[node.left + frame.step], 0});
+                    continue;
+                }
+                result = values.back();
+                values.pop_back();
+            } else if (node.kind == NodeKind::Reduce) {
+                // The running value stays on the stack; each operand is folded in once evaluated.
+                if (frame.step > 1) {
+                    int b = values.back();
+                    values.pop_back();
+                    values.back() = applyStrict(op, values.back(), b);
+                }
+                if (frame.step < node.right) {
+                    frames.push_back({frame.node, frame.step + 1});
+                    frames.push_back({operands[node.left + frame.step], 0});
+                    continue;
+                }
+                result = values.back();
+                values.pop_back();
+            } else if (!hasFlags(op.flags, OperatorFlags::Strict)) {
+                result = call(evaluation, node);
+            } else if (frame.step == 0) {
+                frames.push_back({frame.node, 1});
+                frames.push_back({node.right, 0});
+                frames.push_back({node.left, 0});
+                continue;
+            } else {
+                int b = values.back();
+                values.pop_back();
+                int a = values.back();
+                values.pop_back();
+                result = applyStrict(op, a, b);
+            }
+            if (memoizedNode) {
+                evaluation.memo[frame.node] = result;
+                evaluation.known[frame.node] = true;
+            }
+            values.push_back(result);
+        }
+        int result = values.back();
+        values.pop_back();
+        return result;
+    }
+
+    // Keeps the operators referenced from operatorSlots alive.
+    std::shared_ptr<const OperatorTable> operators;
+    std::pmr::vector<const OperatorDefinition *> operatorSlots;
+    std::pmr::vector<Node> nodes;
+    // Operand lists of Reduce and Sequence nodes. A list may be a prefix of a longer one.
+    std::pmr::vector<Index> operands;
+    Index root = 0;
+    std::size_t rootDepth = 0;
+    std::size_t inputCount = 0;
+    bool memoized = false;
+};
+
+class PlanBuilder {
+private:
+    using Index = ExpressionPlan::Index;
+    using Node = ExpressionPlan::Node;
+    using NodeKind = ExpressionPlan::NodeKind;
+
+    static constexpr std::int16_t noSlot = -1;
+    static constexpr Index noNode = std::numeric_limits<Index>::max();
+    // Longest operand list copied into a new reduction rather than nested in it.
+    static constexpr Index maxCopied = 16;
+
+    friend class RealTimeCalculator;
+
+    std::shared_ptr<const OperatorTable> operators;
+    std::shared_ptr<ExpressionPlan> plan;
+    std::pmr::vector<Index> stack;
+    std::int16_t slots[256];
+    // Open-addressing set of node indices, used to hash-cons identical nodes.
+    std::pmr::vector<Index> interned;
+    std::size_t garbage = 0;
+    std::size_t nodeLimit = noNode;
+    bool memoizePure;
+
+    static std::size_t hashOf(const Node &node) {
+        std::uint64_t h = static_cast<std::uint8_t>(node.kind);
+        h = h * 31 + static_cast<unsigned char>(node.symbol);
+        h = h * 0x9E3779B97F4A7C15ull + static_cast<std::uint32_t>(node.value);
+        h = h * 0x9E3779B97F4A7C15ull + node.left;
+        h = h * 0x9E3779B97F4A7C15ull + node.right;
+        return static_cast<std::size_t>(h ^ (h >> 29));
+    }
+
+    static bool sameNode(const Node &a, const Node &b) {
+        return a.kind == b.kind && a.symbol == b.symbol && a.value == b.value
+               && a.left == b.left && a.right == b.right;
+    }
+
+    void rehash(std::size_t capacity) {
+        interned.assign(capacity, noNode);
+        for (Index i = 0; i < plan->nodes.size(); i++) {
+            std::size_t at = hashOf(plan->nodes[i]) & (capacity - 1);
+            while (interned[at] != noNode) {
+                at = (at + 1) & (capacity - 1);
+            }
+            interned[at] = i;
+        }
+    }
+
+    // Returns the index of an identical node if one exists, appending it
+    // otherwise. Past the node limit, returns noNode.
+    Index intern(const Node &node) {
+        if (2 * (plan->nodes.size() + 1) > interned.size()) {
+            rehash(std::max<std::size_t>(16, 2 * interned.size()));
+        }
+        std::size_t mask = interned.size() - 1;
+        std::size_t at = hashOf(node) & mask;
+        while (interned[at] != noNode) {
+            if (sameNode(plan->nodes[interned[at]], node)) {
+                return interned[at];
+            }
+            at = (at + 1) & mask;
+        }
+        if (plan->nodes.size() >= nodeLimit) {
+            if (nodeLimit != noNode) {
+                return noNode;
+            }
+            throw std::length_error("Expression is too long");
+        }
+        plan->nodes.push_back(node);
+        interned[at] = static_cast<Index>(plan->nodes.size() - 1);
+        return interned[at];
+    }
+
+    Index literal(int value) {
+        return intern(Node{NodeKind::Literal, 0, ExpressionPlan::PureNode, value, 0, 0});
+    }
+
+    Index input(int slot) {
+        return intern(Node{NodeKind::Input, 0, ExpressionPlan::PureNode, slot, 0, 0});
+    }
+
+    std::int16_t slotOf(char c, const OperatorDefinition &op) {
+        std::int16_t &slot = slots[static_cast<unsigned char>(c)];
+        if (slot == noSlot) {
+            slot = static_cast<std::int16_t>(plan->operatorSlots.size());
+            plan->operatorSlots.push_back(&op);
+        }
+        return slot;
+    }
+
+    // Evaluates a pure operator applied to two literals while parsing.
+    bool fold(const OperatorDefinition &op, Index b, Index a, int &result) {
+        std::pmr::vector<Node> &nodes = plan->nodes;
+        if (!hasFlags(op.flags, OperatorFlags::Pure)
+            || nodes[a].kind != NodeKind::Literal
+            || nodes[b].kind != NodeKind::Literal) {
+            return false;
+        }
+        int left = nodes[b].value;
+        int right = nodes[a].value;
+        // Built-in division traps instead of throwing; leave it for evaluation.
+        if (op.symbol == '/' && (right == 0 || (right == -1 && left == std::numeric_limits<int>::min()))) {
+            return false;
+        }
+        try {
+            result = applyStrict(op, left, right);
+        }
+        catch (...) {
+            return false;
+        }
+        garbage++;
+        return true;
+    }
+
+    static bool variadic(const Node &node) {
+        return node.kind == NodeKind::Reduce || node.kind == NodeKind::Sequence;
+    }
+
+    bool reduces(Index i, std::int16_t slot) const {
+        const Node &node = plan->nodes[i];
+        return (node.kind == NodeKind::Call || variadic(node)) && node.value == slot;
+    }
+
+    bool atTail(Index i, std::int16_t slot) const {
+        const Node &node = plan->nodes[i];
+        return variadic(node) && node.value == slot && node.left + node.right == plan->operands.size();
+    }
+
+    // Appends the operands of a call or short list of the same operator,
+    // the node itself otherwise.
+    void appendOperands(Index i, std::int16_t slot) {
+        std::pmr::vector<Index> &operands = plan->operands;
+        const Node node = plan->nodes[i];
+        if (operands.size() + maxCopied >= noNode) {
+            throw std::length_error("Expression is too long");
+        }
+        if (node.kind == NodeKind::Call && node.value == slot) {
+            operands.push_back(node.left);
+            operands.push_back(node.right);
+        } else if (variadic(node) && node.value == slot && node.right <= maxCopied) {
+            for (Index k = node.left; k < node.left + node.right; k++) {
+                operands.push_back(operands[k]);
+            }
+        } else {
+            operands.push_back(i);
+        }
+    }
+
+    // Flattens a chain of an associative operator, or of a sequencing one,
+    // into a single node. A list at the end of operands is extended in place,
+    // so chains grow in linear time; the commutative case also takes
+    // right-deep chains in place, but only when reordering cannot be observed.
+    Index reduce(NodeKind kind, char c, const OperatorDefinition &op, std::int16_t slot, Index b, Index a,
+                 std::uint8_t flags) {
+        std::pmr::vector<Index> &operands = plan->operands;
+        Index start;
+        if (atTail(b, slot)) {
+            start = plan->nodes[b].left;
+            appendOperands(a, slot);
+        } else if (kind == NodeKind::Reduce && atTail(a, slot) && hasFlags(op.flags, OperatorFlags::Commutative)
+                   && (plan->nodes[a].flags & plan->nodes[b].flags & ExpressionPlan::PureNode)) {
+            start = plan->nodes[a].left;
+            appendOperands(b, slot);
+        } else {
+            start = static_cast<Index>(operands.size());
+            appendOperands(b, slot);
+            appendOperands(a, slot);
+        }
+        // The node flattened into this one is usually left unreachable.
+        garbage++;
+        return intern(Node{kind, c, flags, slot, start, static_cast<Index>(operands.size() - start)});
+    }
+
+    // Stands in for an operand the operator never reads; compaction later
+    // drops the subtree unless it is shared.
+    Index discard(Index i) {
+        if (plan->nodes[i].kind == NodeKind::Literal) {
+            return i;
+        }
+        garbage++;
+        return literal(0);
+    }
+
+    // Counts how many parents reach each node from the root; zero means unreachable.
+    std::pmr::vector<Index> countParents() const {
+        std::pmr::memory_resource *resource = stack.get_allocator().resource();
+        std::pmr::vector<Index> parents(plan->nodes.size(), 0, resource);
+        std::pmr::vector<Index> work({plan->root}, resource);
+        parents[plan->root] = 1;
+        while (!work.empty()) {
+            const Node &node = plan->nodes[work.back()];
+            work.pop_back();
+            plan->forEachChild(node, [&parents, &work](Index child) {
+                if (parents[child]++ == 0) {
+                    work.push_back(child);
+                }
+            });
+        }
+        return parents;
+    }
+
+    // Drops nodes left behind by folding. Children always precede their
+    // parents, so a single forward pass can renumber everything.
+    void compact(const std::pmr::vector<Index> &parents) {
+        std::pmr::vector<Node> &nodes = plan->nodes;
+        std::pmr::vector<Index> renumbered(nodes.size(), noNode, stack.get_allocator().resource());
+        Index next = 0;
+        for (Index i = 0; i < nodes.size(); i++) {
+            if (parents[i] == 0) {
+                continue;
+            }
+            Node node = nodes[i];
+            if (node.kind == NodeKind::Call) {
+                node.left = renumbered[node.left];
+                node.right = renumbered[node.right];
+            }
+            renumbered[i] = next;
+            nodes[next++] = node;
+        }
+        nodes.resize(next);
+        nodes.shrink_to_fit();
+        // Lists are shared between reductions, so each entry is renumbered once,
+        // here. Entries only unreachable reductions read become noNode.
+        for (Index &operand : plan->operands) {
+            operand = renumbered[operand];
+        }
+        plan->root = renumbered[plan->root];
+    }
+
+    // Node for op applied to b and a, or noNode past the node limit.
+    Index apply(char c, const OperatorDefinition &op, Index b, Index a) {
+        if (hasFlags(op.flags, OperatorFlags::IgnoresLeft)) {
+            b = discard(b);
+        }
+        if (hasFlags(op.flags, OperatorFlags::IgnoresRight)) {
+            a = discard(a);
+        }
+        if (a == noNode || b == noNode) {
+            return noNode;
+        }
+        int folded;
+        if (fold(op, b, a, folded)) {
+            return literal(folded);
+        }
+        std::uint8_t flags = 0;
+        if (hasFlags(op.flags, OperatorFlags::Pure)
+            && (plan->nodes[a].flags & plan->nodes[b].flags & ExpressionPlan::PureNode)) {
+            flags = ExpressionPlan::PureNode;
+        }
+        std::int16_t operatorSlot = slotOf(c, op);
+        if (hasFlags(op.flags, OperatorFlags::Sequencing)) {
+            return reduce(NodeKind::Sequence, c, op, operatorSlot, b, a, flags);
+        }
+        if (hasFlags(op.flags, OperatorFlags::Pure | OperatorFlags::Strict | OperatorFlags::Associative)
+            && (reduces(b, operatorSlot) || reduces(a, operatorSlot))) {
+            return reduce(NodeKind::Reduce, c, op, operatorSlot, b, a, flags);
+        }
+        return intern(Node{NodeKind::Call, c, flags, operatorSlot, b, a});
+    }
+
+    void start() {
+        std::pmr::memory_resource *resource = stack.get_allocator().resource();
+        plan = std::allocate_shared<ExpressionPlan>(std::pmr::polymorphic_allocator<ExpressionPlan>(resource),
+                                                    resource);
+        plan->operators = operators;
+        plan->inputCount = operators->inputSlots();
+        for (std::int16_t &slot : slots) {
+            slot = noSlot;
+        }
+    }
+
+public:
+    // The plan, its control block and every temporary come from the resource.
+    PlanBuilder(std::shared_ptr<const OperatorTable> operators, std::size_t sizeHint = 0,
+                bool memoizePure = false,
+                std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+            : operators(std::move(operators)), stack(resource), interned(resource), memoizePure(memoizePure) {
+        start();
+        plan->nodes.reserve(sizeHint);
+    }
+
+    // Drops everything pushed so far, or what finish left behind, and starts
+    // a new plan with the same operators.
+    void reset() {
+        stack.clear();
+        interned.clear();
+        garbage = 0;
+        start();
+    }
+
+    // Fails with CapacityExceeded instead of storing more nodes.
+    void limitNodes(std::size_t limit) {
+        nodeLimit = std::min<std::size_t>(limit, noNode);
+    }
+
+    // Like push, but returns the error instead of throwing it.
+    CalculationStatus tryPush(char c) {
+        Index pushed;
+        int slot = plan->operators->inputSlot(c);
+        if (isLiteral(c)) {
+            pushed = literal(c - '0');
+        } else if (slot >= 0) {
+            pushed = input(slot);
+        } else {
+            const OperatorDefinition *op = plan->operators->find(c);
+            if (op == nullptr) {
+                return CalculationStatus::UnknownOperator;
+            }
+            if (stack.size() < 2) {
+                return CalculationStatus::SyntaxError;
+            }
+            Index a = stack.back();
+            stack.pop_back();
+            Index b = stack.back();
+            stack.pop_back();
+            pushed = apply(c, *op, b, a);
+        }
+        if (pushed == noNode) {
+            return CalculationStatus::CapacityExceeded;
+        }
+        stack.push_back(pushed);
+        return CalculationStatus::Ok;
+    }
+
+    void push(char c) {
+        throwIfFailed(tryPush(c));
+    }
+
+    // Like finish, but returns the error instead of throwing it.
+    CalculationStatus tryFinish(std::shared_ptr<const ExpressionPlan> &result) {
+        if (stack.size() != 1) {
+            return CalculationStatus::SyntaxError;
+        }
+        result = finish();
+        return CalculationStatus::Ok;
+    }
+
+    std::shared_ptr<const ExpressionPlan> finish() {
+        if (stack.size() != 1) {
+            throw SyntaxError();
+        }
+        plan->root = stack.back();
+        stack.clear();
+        interned.clear();
+        if (garbage > 0 || memoizePure) {
+            std::pmr::vector<Index> parents = countParents();
+            if (memoizePure) {
+                for (Index i = 0; i < plan->nodes.size(); i++) {
+                    Node &node = plan->nodes[i];
+                    if ((node.kind == NodeKind::Call || variadic(node))
+                        && (node.flags & ExpressionPlan::PureNode) && parents[i] > 1) {
+                        node.flags |= ExpressionPlan::MemoizedNode;
+                        plan->memoized = true;
+                    }
+                }
+            }
+            if (garbage > 0) {
+                compact(parents);
+            }
+        }
+        plan->rootDepth = plan->longestPath(stack.get_allocator().resource());
+        return std::move(plan);
+    }
+};
+
+constexpr std::int16_t PlanBuilder::noSlot;
+constexpr PlanBuilder::Index PlanBuilder::noNode;
+constexpr PlanBuilder::Index PlanBuilder::maxCopied;
+
+// Stack machine program compiled from an ExpressionPlan. Built-in arithmetic
+// runs as native opcodes; user operators become Call instructions whose
+// operands are separate code blocks handed to the operator as lazy thunks.
+class BytecodeProgram : public std::enable_shared_from_this<BytecodeProgram> {
+public:
+    enum class OpCode : std::uint8_t {
+        Push,
+        Load,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Pop,
+        Call,
+        CallByNeed,
+        CallStrict,
+        Return
+    };
+
+    struct Instruction {
+        OpCode code;
+        std::int32_t operand; // Push: the value, Load: input slot, Call*: index into calls.
+    };
+
+    struct CallSite {
+        const OperatorDefinition *op;
+        // Entry points of the operand blocks. CallStrict finds its operands
+        // on the stack instead.
+        std::uint32_t left;
+        std::uint32_t right;
+    };
+
+    // Operators may keep their operands and call them after run returns.
+    int run(const int *inputs = nullptr) const {
+        return run(0, inputs);
+    }
+
+    std::size_t size() const {
+        return code.size();
+    }
+
+private:
+    friend class BytecodeCompiler;
+
+    struct Execution;
+    using Operands = OperandLinks<BytecodeProgram, Execution, std::uint32_t>;
+    friend Operands;
+
+    struct Execution {
+        const BytecodeProgram *program;
+        const int *inputs;
+        std::vector<int> stack;
+        std::shared_ptr<Operands::Scope> scope; // Created by the first call.
+
+        ~Execution() {
+            Operands::close(scope, inputs, program->inputCount);
+        }
+    };
+
+    static int resume(Execution &execution, std::uint32_t entry) {
+        return execution.program->run(execution, entry);
+    }
+
+    int restart(std::uint32_t entry, const int *inputs, std::pmr::memory_resource *) const {
+        return run(entry, inputs);
+    }
+
+    int run(std::uint32_t entry, const int *inputs) const {
+        Execution execution{this, inputs, {}, nullptr};
+        execution.stack.reserve(maxDepth);
+        return run(execution, entry);
+    }
+
+    int call(Execution &execution, const CallSite &site, bool byNeed) const {
+        return Operands::call(*site.op, *this, execution, execution.scope, site.left, site.right, byNeed,
+                              std::pmr::get_default_resource());
+    }
+
+    int run(Execution &execution, std::uint32_t pc) const {
+        std::vector<int> &stack = execution.stack;
+        for (;;) {
+            const Instruction &instruction = code[pc++];
+            switch (instruction.code) {
+                case OpCode::Push:
+                    stack.push_back(instruction.operand);
+                    break;
+                case OpCode::Load:
+                    if (execution.inputs == nullptr) {
+                        throw UnboundInput();
+                    }
+                    stack.push_back(execution.inputs[instruction.operand]);
+                    break;
+                case OpCode::Add: {
+                    int b = stack.back();
+                    stack.pop_back();
+                    stack.back() = stack.back() + b;
+                    break;
+                }
+                case OpCode::Subtract: {
+                    int b = stack.back();
+                    stack.pop_back();
+                    stack.back() = stack.back() - b;
+                    break;
+                }
+                case OpCode::Multiply: {
+                    int b = stack.back();
+                    stack.pop_back();
+                    stack.back() = stack.back() * b;
+                    break;
+                }
+                case OpCode::Divide: {
+                    int b = stack.back();
+                    stack.pop_back();
+                    stack.back() = stack.back() / b;
+                    break;
+                }
+                case OpCode::Pop:
+                    stack.pop_back();
+                    break;
+                case OpCode::Call:
+                case OpCode::CallByNeed: {
+                    std::size_t depth = stack.size();
+                    int result = call(execution, calls[instruction.operand], instruction.code == OpCode::CallByNeed);
+                    // An operator may swallow an exception thrown halfway through an operand.
+                    stack.resize(depth);
+                    stack.push_back(result);
+                    break;
+                }
+                case OpCode::CallStrict: {
+                    int b = stack.back();
+                    stack.pop_back();
+                    stack.back() = applyStrict(*calls[instruction.operand].op, stack.back(), b);
+                    break;
+                }
+                case OpCode::Return: {
+                    int result = stack.back();
+                    stack.pop_back();
+                    return result;
+                }
+            }
+        }
+    }
+
+    std::shared_ptr<const OperatorTable> operators;
+    std::vector<Instruction> code;
+    std::vector<CallSite> calls;
+    std::size_t maxDepth = 0;
+    std::size_t inputCount = 0;
+};
+
+class BytecodeCompiler {
+private:
+    using Index = ExpressionPlan::Index;
+    using Node = ExpressionPlan::Node;
+    using OpCode = BytecodeProgram::OpCode;
+
+    struct PendingBlock {
+        Index node;
+        std::size_t call;
+        bool left;
+    };
+
+    const ExpressionPlan &plan;
+    std::shared_ptr<BytecodeProgram> program;
+    std::vector<PendingBlock> pending;
+
+    static bool nativeOpCode(char c, OpCode &code) {
+        switch (c) {
+            case '+': code = OpCode::Add; return true;
+            case '-': code = OpCode::Subtract; return true;
+            case '*': code = OpCode::Multiply; return true;
+            case '/': code = OpCode::Divide; return true;
+            default: return false;
+        }
+    }
+
+    void emit(OpCode code, std::int32_t operand = 0) {
+        program->code.push_back({code, operand});
+    }
+
+    // Emits one block in postfix order without recursing on the native stack.
+    void compileBlock(Index root) {
+        std::vector<std::pair<Index, bool>> work{{root, false}};
+        std::size_t depth = 0;
+        while (!work.empty()) {
+            Index i = work.back().first;
+            bool expanded = work.back().second;
+            work.pop_back();
+            const Node &node = plan.nodes[i];
+            OpCode code;
+            if (node.kind == ExpressionPlan::NodeKind::Literal) {
+                emit(OpCode::Push, node.value);
+                depth++;
+            } else if (node.kind == ExpressionPlan::NodeKind::Input) {
+                emit(OpCode::Load, node.value);
+                depth++;
+            } else if (node.kind == ExpressionPlan::NodeKind::Sequence) {
+                if (expanded) {
+                    emit(OpCode::Pop);
+                    depth--;
+                } else {
+                    // Every operand but the last is popped straight after it runs.
+                    work.push_back({plan.operands[node.left + node.right - 1], false});
+                    for (Index k = node.right - 1; k-- > 0;) {
+                        work.push_back({i, true});
+                        work.push_back({plan.operands[node.left + k], false});
+                    }
+                }
+            } else if (node.kind == ExpressionPlan::NodeKind::Reduce && !expanded) {
+                // Every operand after the first is followed by one binary instruction.
+                for (Index k = node.right; k-- > 1;) {
+                    work.push_back({i, true});
+                    work.push_back({plan.operands[node.left + k], false});
+                }
+                work.push_back({plan.operands[node.left], false});
+            } else if (nativeOpCode(node.symbol, code)) {
+                if (expanded) {
+                    emit(code);
+                    depth--;
+                } else {
+                    work.push_back({i, true});
+                    work.push_back({node.right, false});
+                    work.push_back({node.left, false});
+                }
+            } else if (hasFlags(plan.operatorSlots[node.value]->flags, OperatorFlags::Strict)) {
+                // Strict operands run inline, so deep strict chains do not nest run().
+                if (expanded) {
+                    emit(OpCode::CallStrict, static_cast<std::int32_t>(program->calls.size()));
+                    program->calls.push_back({plan.operatorSlots[node.value], 0, 0});
+                    depth--;
+                } else {
+                    work.push_back({i, true});
+                    work.push_back({node.right, false});
+                    work.push_back({node.left, false});
+                }
+            } else {
+                std::size_t call = program->calls.size();
+                const OperatorDefinition &op = *plan.operatorSlots[node.value];
+                program->calls.push_back({&op, 0, 0});
+                pending.push_back({node.left, call, true});
+                pending.push_back({node.right, call, false});
+                emit(hasFlags(op.flags, OperatorFlags::CallByNeed) ? OpCode::CallByNeed : OpCode::Call,
+                     static_cast<std::int32_t>(call));
+                depth++;
+            }
+            program->maxDepth = std::max(program->maxDepth, depth);
+        }
+        emit(OpCode::Return);
+    }
+
+public:
+    explicit BytecodeCompiler(const ExpressionPlan &plan)
+            : plan(plan), program(std::make_shared<BytecodeProgram>()) {
+        program->operators = plan.operators;
+        program->inputCount = plan.inputCount;
+    }
+
+    std::shared_ptr<const BytecodeProgram> compile() {
+        compileBlock(plan.root);
+        while (!pending.empty()) {
+            PendingBlock block = pending.back();
+            pending.pop_back();
+            auto entry = static_cast<std::uint32_t>(program->code.size());
+            BytecodeProgram::CallSite &site = program->calls[block.call];
+            (block.left ? site.left : site.right) = entry;
+            compileBlock(block.node);
+        }
+        return std::move(program);
+    }
+};
+
+// Parser fed with an expression piece by piece, e.g. while it still arrives
+// from a pipe. Only the operand stack and the plan built so far are kept
+// between feeds, never the text. A successful finish starts over, so the
+// parser can read the next expression; after an exception it is unusable.
+class IncrementalParser {
+private:
+    PlanBuilder builder;
+
+public:
+    explicit IncrementalParser(PlanBuilder builder) : builder(std::move(builder)) {
+    }
+
+    IncrementalParser &feed(const char *data, std::size_t size) {
+        for (std::size_t i = 0; i < size; i++) {
+            builder.push(data[i]);
+        }
+        return *this;
+    }
+
+    IncrementalParser &feed(const std::string &chunk) {
+        return feed(chunk.data(), chunk.size());
+    }
+
+    std::shared_ptr<const ExpressionPlan> finishPlan() {
+        std::shared_ptr<const ExpressionPlan> plan = builder.finish();
+        builder.reset();
+        return plan;
+    }
+
+    InlineLazy finish() {
+        std::shared_ptr<const ExpressionPlan> plan = finishPlan();
+        return [plan]() { return plan->evaluate(); };
+    }
+};
+
+// Thread pool where every worker owns a deque of tasks. Workers take their
+// own newest task first and steal the oldest task of another worker when
+// they run dry, so a few expensive tasks do not leave other threads idle.
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit WorkStealingPool(std::size_t threads = defaultThreads()) {
+        threads = std::max<std::size_t>(threads, 1);
+        for (std::size_t i = 0; i < threads; i++) {
+            queues.emplace_back(new Queue());
+        }
+        for (std::size_t i = 0; i < threads; i++) {
+            workers.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    static std::size_t defaultThreads() {
+        return std::max<unsigned>(std::thread::hardware_concurrency(), 1u);
+    }
+
+    std::size_t size() const {
+        return workers.size();
+    }
+
+    void submit(Task task) {
+        std::size_t queue = currentPool == this ? currentQueue : nextQueue++ % queues.size();
+        {
+            // Counted before the queue lock is released, so take() never
+            // sees the task without its count.
+            std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+            queues[queue]->tasks.push_back(std::move(task));
+            pending++;
+        }
+        // A worker counts itself as a sleeper before it checks pending, so
+        // one of the two always sees the other. Taking the lock orders the
+        // notification after the sleeper's check.
+        if (sleepers > 0) {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            wake.notify_one();
+        }
+    }
+
+    // Runs one queued task on the calling thread, if there is any. Used by
+    // threads that wait for tasks to finish, so that waiting never deadlocks.
+    bool runPending() {
+        Task task;
+        std::size_t home = currentPool == this ? currentQueue : 0;
+        if (!take(home, task)) {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    static thread_local WorkStealingPool *currentPool;
+    static thread_local std::size_t currentQueue;
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<std::size_t> nextQueue{0};
+    // Only taken by workers going to sleep and by whoever wakes them.
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<std::size_t> pending{0};
+    std::atomic<std::size_t> sleepers{0};
+    bool stopping = false;
+
+    bool take(std::size_t home, Task &task) {
+        for (std::size_t i = 0; i < queues.size(); i++) {
+            Queue &queue = *queues[(home + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            pending--;
+            return true;
+        }
+        return false;
+    }
+
+    void work(std::size_t index) {
+        currentPool = this;
+        currentQueue = index;
+        NativeStack::prepare();
+        Task task;
+        for (;;) {
+            if (take(index, task)) {
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepers++;
+            wake.wait(lock, [this]() { return stopping || pending > 0; });
+            sleepers--;
+            if (stopping && pending == 0) {
+                return;
+            }
+        }
+    }
+};
+
+thread_local WorkStealingPool *WorkStealingPool::currentPool = nullptr;
+thread_local std::size_t WorkStealingPool::currentQueue = 0;
+
+// Tasks submitted to a pool that can be waited for together by one thread.
+// The waiting thread helps with queued work and otherwise sleeps until a
+// task of the group finishes; the first exception thrown by a task is
+// rethrown from wait().
+class TaskGroup {
+private:
+    // Shared with the tasks, which may still signal it after wait() returned.
+    struct State {
+        std::atomic<std::size_t> outstanding{0};
+        // Tasks finished so far. Waiters sleep on it rather than on the count,
+        // which can return to a value they already saw.
+        std::atomic<std::uint32_t> finished{0};
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+
+    WorkStealingPool &pool;
+    std::shared_ptr<State> state = std::make_shared<State>();
+
+public:
+    explicit TaskGroup(WorkStealingPool &pool) : pool(pool) {
+    }
+
+    void run(WorkStealingPool::Task task) {
+        state->outstanding++;
+        pool.submit([state = state, task]() {
+            try {
+                task();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(state->errorMutex);
+                if (!state->error) {
+                    state->error = std::current_exception();
+                }
+            }
+            state->outstanding--;
+            state->finished++;
+            state->finished.notify_one();
+        });
+    }
+
+    void wait() {
+        for (;;) {
+            std::uint32_t seen = state->finished;
+            if (state->outstanding == 0) {
+                break;
+            }
+            if (!pool.runPending()) {
+                state->finished.wait(seen);
+            }
+        }
+        if (state->error) {
+            std::rethrow_exception(state->error);
+        }
+    }
+};
+
+struct BatchResult {
+    int value = 0;
+    std::exception_ptr error; // Set when the expression could not be calculated.
+};
+
+// Expression parsed once and evaluated many times with different values
+// bound to its input slots. Binding is just passing an array.
+class PreparedExpression {
+private:
+    using Index = ExpressionPlan::Index;
+    using Node = ExpressionPlan::Node;
+
+    std::shared_ptr<const ExpressionPlan> plan;
+    std::shared_ptr<WorkStealingPool> pool;
+    Index parallelThreshold = 0;
+    // Tree nodes under each plan node, shared subtrees counted at every use.
+    std::vector<Index> weights;
+
+    // Operands of a pure strict operator can run on two threads; only worth
+    // a task when both of them are heavy.
+    bool splits(const Node &node) const {
+        if (node.kind != ExpressionPlan::NodeKind::Call || !(node.flags & ExpressionPlan::PureNode)
+            || std::min(weights[node.left], weights[node.right]) < parallelThreshold) {
+            return false;
+        }
+        return hasFlags(plan->operatorSlots[node.value]->flags, OperatorFlags::Strict);
+    }
+
+    // Runs left as a task while this thread runs right. The left error wins,
+    // as it would sequentially.
+    template<typename Left, typename Right>
+    void inParallel(Left left, Right right) const {
+        std::exception_ptr error;
+        TaskGroup group(*pool);
+        group.run(left);
+        try {
+            right();
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        group.wait();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    Index weightOf(Index begin, Index end) const {
+        std::uint64_t weight = 0;
+        for (Index k = begin; k < end; k++) {
+            weight += weights[plan->operands[k]];
+        }
+        return static_cast<Index>(std::min<std::uint64_t>(weight, std::numeric_limits<Index>::max()));
+    }
+
+    // Operands begin to end of a pure reduction, halved while both halves are
+    // heavy. Associativity makes the bracketing irrelevant.
+    int reduce(const Node &node, Index begin, Index end, const int *inputs) const {
+        const OperatorDefinition &op = *plan->operatorSlots[node.value];
+        Index middle = begin + (end - begin) / 2;
+        if (end - begin >= 2 && weightOf(begin, middle) >= parallelThreshold
+            && weightOf(middle, end) >= parallelThreshold) {
+            int left = 0;
+            int right = 0;
+            inParallel([&]() { left = reduce(node, begin, middle, inputs); },
+                       [&]() { right = reduce(node, middle, end, inputs); });
+            return applyStrict(op, left, right);
+        }
+        int value = evaluate(plan->operands[begin], inputs);
+        for (Index k = begin + 1; k < end; k++) {
+            value = applyStrict(op, value, evaluate(plan->operands[k], inputs));
+        }
+        return value;
+    }
+
+    int evaluate(Index i, const int *inputs) const {
+        const Node &node = plan->nodes[i];
+        if (node.kind == ExpressionPlan::NodeKind::Reduce && (node.flags & ExpressionPlan::PureNode)
+            && weights[i] / 2 >= parallelThreshold) {
+            return reduce(node, node.left, node.left + node.right, inputs);
+        }
+        if (!splits(node)) {
+            return plan->evaluateNode(i, inputs);
+        }
+        int left = 0;
+        int right = 0;
+        inParallel([&]() { left = evaluate(node.left, inputs); },
+                   [&]() { right = evaluate(node.right, inputs); });
+        return applyStrict(*plan->operatorSlots[node.value], left, right);
+    }
+
+public:
+    explicit PreparedExpression(std::shared_ptr<const ExpressionPlan> plan) : plan(std::move(plan)) {
+    }
+
+    // Evaluates both operands of pure strict operators concurrently on the
+    // pool when each spans at least parallelThreshold nodes.
+    PreparedExpression(std::shared_ptr<const ExpressionPlan> plan, std::shared_ptr<WorkStealingPool> pool,
+                       std::size_t parallelThreshold)
+            : plan(std::move(plan)), pool(std::move(pool)),
+              parallelThreshold(static_cast<Index>(std::min<std::size_t>(std::max<std::size_t>(parallelThreshold, 1),
+                                                                          std::numeric_limits<Index>::max()))) {
+        const std::pmr::vector<Node> &nodes = this->plan->nodes;
+        weights.assign(nodes.size(), 1);
+        for (Index i = 0; i < nodes.size(); i++) {
+            std::uint64_t weight = 1;
+            this->plan->forEachChild(nodes[i], [this, &weight](Index child) { weight += weights[child]; });
+            weights[i] = static_cast<Index>(std::min<std::uint64_t>(weight, std::numeric_limits<Index>::max()));
+        }
+    }
+
+    std::size_t inputSlots() const {
+        return plan->inputSlots();
+    }
+
+    // inputs must hold a value for every slot, indexed by slot.
+    int operator()(const int *inputs) const {
+        if (pool) {
+            return evaluate(plan->root, inputs);
+        }
+        return plan->evaluate(inputs);
+    }
+
+    int operator()(std::initializer_list<int> inputs) const {
+        if (inputs.size() < inputSlots()) {
+            throw UnboundInput();
+        }
+        return (*this)(inputs.begin());
+    }
+
+    int operator()(const std::vector<int> &inputs) const {
+        if (inputs.size() < inputSlots()) {
+            throw UnboundInput();
+        }
+        return (*this)(inputs.data());
+    }
+
+    const ExpressionPlan &expressionPlan() const {
+        return *plan;
+    }
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LAZY_CALCULATOR_X86_KERNELS 1
+#endif
+
+enum class InstructionSet {
+    Scalar,
+    Avx2,
+    Avx512
+};
+
+// Element-wise kernels over int columns. Addition, subtraction and
+// multiplication wrap around; division traps on zero and INT_MIN / -1
+// exactly like the interpreter does.
+struct ColumnKernels {
+    using Kernel = void (*)(const int *, const int *, int *, std::size_t);
+
+    Kernel add;
+    Kernel subtract;
+    Kernel multiply;
+    Kernel divide;
+};
+
+namespace column_kernels {
+
+inline void addScalar(const int *a, const int *b, int *out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = static_cast<int>(static_cast<unsigned>(a[i]) + static_cast<unsigned>(b[i]));
+    }
+}
+
+inline void subtractScalar(const int *a, const int *b, int *out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = static_cast<int>(static_cast<unsigned>(a[i]) - static_cast<unsigned>(b[i]));
+    }
+}
+
+inline void multiplyScalar(const int *a, const int *b, int *out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = static_cast<int>(static_cast<unsigned>(a[i]) * static_cast<unsigned>(b[i]));
+    }
+}
+
+inline void divideScalar(const int *a, const int *b, int *out, std::size_t n) {
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = a[i] / b[i];
+    }
+}
+
+#ifdef LAZY_CALCULATOR_X86_KERNELS
+
+__attribute__((target("avx2")))
+inline void addAvx2(const int *a, const int *b, int *out, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_add_epi32(x, y));
+    }
+    addScalar(a + i, b + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void subtractAvx2(const int *a, const int *b, int *out, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_sub_epi32(x, y));
+    }
+    subtractScalar(a + i, b + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void multiplyAvx2(const int *a, const int *b, int *out, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_mullo_epi32(x, y));
+    }
+    multiplyScalar(a + i, b + i, out + i, n - i);
+}
+
+// There is no integer division instruction; int32 operands divide exactly
+// in double precision, and truncating the quotient gives the C++ result.
+__attribute__((target("avx2")))
+inline void divideAvx2(const int *a, const int *b, int *out, std::size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i minimum = _mm256_set1_epi32(std::numeric_limits<int>::min());
+    const __m256i minusOne = _mm256_set1_epi32(-1);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+        __m256i invalid = _mm256_or_si256(
+                _mm256_cmpeq_epi32(y, zero),
+                _mm256_and_si256(_mm256_cmpeq_epi32(x, minimum), _mm256_cmpeq_epi32(y, minusOne)));
+        if (!_mm256_testz_si256(invalid, invalid)) {
+            divideScalar(a + i, b + i, out + i, 8);
+            continue;
+        }
+        __m256d low = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(x)),
+                                    _mm256_cvtepi32_pd(_mm256_castsi256_si128(y)));
+        __m256d high = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1)),
+                                     _mm256_cvtepi32_pd(_mm256_extracti128_si256(y, 1)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                            _mm256_set_m128i(_mm256_cvttpd_epi32(high), _mm256_cvttpd_epi32(low)));
+    }
+    divideScalar(a + i, b + i, out + i, n - i);
+}
+
+// GCC 12 builds the 512-bit conversions and extracts from deliberately
+// undefined vectors inside its own headers and then warns about them.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+inline void addAvx512(const int *a, const int *b, int *out, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i x = _mm512_loadu_si512(a + i);
+        __m512i y = _mm512_loadu_si512(b + i);
+        _mm512_storeu_si512(out + i, _mm512_add_epi32(x, y));
+    }
+    addScalar(a + i, b + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline void subtractAvx512(const int *a, const int *b, int *out, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i x = _mm512_loadu_si512(a + i);
+        __m512i y = _mm512_loadu_si512(b + i);
+        _mm512_storeu_si512(out + i, _mm512_sub_epi32(x, y));
+    }
+    subtractScalar(a + i, b + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline void multiplyAvx512(const int *a, const int *b, int *out, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i x = _mm512_loadu_si512(a + i);
+        __m512i y = _mm512_loadu_si512(b + i);
+        _mm512_storeu_si512(out + i, _mm512_mullo_epi32(x, y));
+    }
+    multiplyScalar(a + i, b + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline void divideAvx512(const int *a, const int *b, int *out, std::size_t n) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i minimum = _mm512_set1_epi32(std::numeric_limits<int>::min());
+    const __m512i minusOne = _mm512_set1_epi32(-1);
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i x = _mm512_loadu_si512(a + i);
+        __m512i y = _mm512_loadu_si512(b + i);
+        __mmask16 invalid = _mm512_cmpeq_epi32_mask(y, zero)
+                            | (_mm512_cmpeq_epi32_mask(x, minimum) & _mm512_cmpeq_epi32_mask(y, minusOne));
+        if (invalid != 0) {
+            divideScalar(a + i, b + i, out + i, 16);
+            continue;
+        }
+        __m256i low = _mm512_cvttpd_epi32(_mm512_div_pd(_mm512_cvtepi32_pd(_mm512_castsi512_si256(x)),
+                                                        _mm512_cvtepi32_pd(_mm512_castsi512_si256(y))));
+        __m256i high = _mm512_cvttpd_epi32(_mm512_div_pd(_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(x, 1)),
+                                                         _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(y, 1))));
+        _mm512_storeu_si512(out + i, _mm512_inserti64x4(_mm512_castsi256_si512(low), high, 1));
+    }
+    divideScalar(a + i, b + i, out + i, n - i);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+} // namespace column_kernels
+
+// Best instruction set of the running CPU that the kernels support.
+inline InstructionSet detectInstructionSet() {
+#ifdef LAZY_CALCULATOR_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return InstructionSet::Avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return InstructionSet::Avx2;
+    }
+#endif
+    return InstructionSet::Scalar;
+}
+
+inline ColumnKernels columnKernels(InstructionSet isa) {
+    using namespace column_kernels;
+#ifdef LAZY_CALCULATOR_X86_KERNELS
+    switch (isa) {
+        case InstructionSet::Avx512:
+            return {addAvx512, subtractAvx512, multiplyAvx512, divideAvx512};
+        case InstructionSet::Avx2:
+            return {addAvx2, subtractAvx2, multiplyAvx2, divideAvx2};
+        case InstructionSet::Scalar:
+            break;
+    }
+#endif
+    return {addScalar, subtractScalar, multiplyScalar, divideScalar};
+}
+
+// Prepared expression evaluated over whole input columns at once, one block
+// of rows at a time. Expressions built only from literals, inputs and the
+// built-in arithmetic run through vector kernels; anything else falls back
+// to evaluating the plan row by row.
+class ColumnarExpression {
+public:
+    static constexpr std::size_t blockRows = 1024;
+
+    explicit ColumnarExpression(PreparedExpression expression,
+                                InstructionSet isa = detectInstructionSet())
+            : expression(std::move(expression)), isa(std::min(isa, detectInstructionSet())),
+              kernels(columnKernels(this->isa)) {
+        vectorizable = compile();
+    }
+
+    bool vectorized() const {
+        return vectorizable;
+    }
+
+    std::size_t inputSlots() const {
+        return expression.inputSlots();
+    }
+
+    InstructionSet instructionSet() const {
+        return vectorizable ? isa : InstructionSet::Scalar;
+    }
+
+    // columns[slot] points to rows values of that input; out receives rows results.
+    void evaluate(const int *const *columns, std::size_t rows, int *out) const {
+        if (!vectorizable) {
+            evaluateRows(columns, rows, out);
+            return;
+        }
+        std::vector<int> registers((registerCount + constants.size()) * blockRows);
+        for (std::size_t first = 0; first < rows; first += blockRows) {
+            evaluateBlock(columns, first, std::min(blockRows, rows - first), registers.data(), out + first);
+        }
+    }
+
+private:
+    using Index = ExpressionPlan::Index;
+    using Node = ExpressionPlan::Node;
+    using NodeKind = ExpressionPlan::NodeKind;
+
+    enum class Source : std::uint8_t {
+        Constant,
+        Column,
+        Register
+    };
+
+    struct Operand {
+        Source source;
+        std::int32_t index; // Constant: the value, Column: input slot, Register: its number.
+    };
+
+    struct Step {
+        ColumnKernels::Kernel kernel;
+        Operand left;
+        Operand right;
+        std::uint32_t target;
+    };
+
+    PreparedExpression expression;
+    InstructionSet isa;
+    ColumnKernels kernels;
+    std::vector<Step> steps;
+    std::vector<int> constants;
+    Operand result{Source::Constant, 0};
+    std::size_t registerCount = 0;
+    bool vectorizable = false;
+
+    ColumnKernels::Kernel kernelOf(char symbol) const {
+        switch (symbol) {
+            case '+': return kernels.add;
+            case '-': return kernels.subtract;
+            case '*': return kernels.multiply;
+            case '/': return kernels.divide;
+            default: return nullptr;
+        }
+    }
+
+    // One step per reachable operator node, in index order, which puts
+    // operands first. Registers are reused once their last reader has run.
+    bool compile() {
+        const ExpressionPlan &plan = expression.expressionPlan();
+        const std::pmr::vector<Node> &nodes = plan.nodes;
+        std::vector<Index> lastUse(nodes.size(), 0);
+        std::vector<bool> reachable(nodes.size(), false);
+        reachable[plan.root] = true;
+        for (Index i = static_cast<Index>(nodes.size()); i-- > 0;) {
+            const Node &node = nodes[i];
+            if (!reachable[i] || node.kind == NodeKind::Literal || node.kind == NodeKind::Input) {
+                continue;
+            }
+            if (kernelOf(node.symbol) == nullptr) {
+                return false;
+            }
+            plan.forEachChild(node, [&reachable, &lastUse, i](Index child) {
+                reachable[child] = true;
+                lastUse[child] = std::max(lastUse[child], i);
+            });
+        }
+
+        std::vector<Operand> operands(nodes.size());
+        std::vector<std::uint32_t> freeRegisters;
+        for (Index i = 0; i < nodes.size(); i++) {
+            const Node &node = nodes[i];
+            if (!reachable[i]) {
+                continue;
+            }
+            if (node.kind == NodeKind::Literal) {
+                operands[i] = {Source::Constant, node.value};
+                continue;
+            }
+            if (node.kind == NodeKind::Input) {
+                operands[i] = {Source::Column, node.value};
+                continue;
+            }
+            std::uint32_t target;
+            if (freeRegisters.empty()) {
+                target = static_cast<std::uint32_t>(registerCount++);
+            } else {
+                target = freeRegisters.back();
+                freeRegisters.pop_back();
+            }
+            operands[i] = {Source::Register, static_cast<std::int32_t>(target)};
+            if (node.kind == NodeKind::Reduce) {
+                // Accumulates in the target register, which no operand occupies.
+                const Index *list = plan.operands.data() + node.left;
+                steps.push_back({kernelOf(node.symbol), operands[list[0]], operands[list[1]], target});
+                for (Index k = 2; k < node.right; k++) {
+                    steps.push_back({kernelOf(node.symbol), operands[i], operands[list[k]], target});
+                }
+            } else {
+                steps.push_back({kernelOf(node.symbol), operands[node.left], operands[node.right], target});
+            }
+            plan.forEachChild(node, [&](Index child) {
+                if (lastUse[child] == i && operands[child].source == Source::Register) {
+                    freeRegisters.push_back(static_cast<std::uint32_t>(operands[child].index));
+                    lastUse[child] = 0;
+                }
+            });
+        }
+        result = operands[plan.root];
+        // Constants are broadcast into registers of their own.
+        for (Step &step : steps) {
+            for (Operand *operand : {&step.left, &step.right}) {
+                if (operand->source == Source::Constant) {
+                    constants.push_back(operand->index);
+                    operand->index = static_cast<std::int32_t>(constants.size() - 1);
+                }
+            }
+        }
+        return true;
+    }
+
+    const int *resolve(const Operand &operand, const int *const *columns, std::size_t first,
+                       const int *registers) const {
+        switch (operand.source) {
+            case Source::Column:
+                return columns[operand.index] + first;
+            case Source::Register:
+                return registers + operand.index * blockRows;
+            case Source::Constant:
+                break;
+        }
+        return registers + (registerCount + operand.index) * blockRows;
+    }
+
+    void evaluateBlock(const int *const *columns, std::size_t first, std::size_t rows,
+                       int *registers, int *out) const {
+        for (std::size_t c = 0; c < constants.size(); c++) {
+            std::fill(registers + (registerCount + c) * blockRows,
+                      registers + (registerCount + c) * blockRows + rows, constants[c]);
+        }
+        for (const Step &step : steps) {
+            step.kernel(resolve(step.left, columns, first, registers),
+                        resolve(step.right, columns, first, registers),
+                        registers + step.target * blockRows, rows);
+        }
+        if (result.source == Source::Constant) {
+            std::fill(out, out + rows, result.index);
+        } else {
+            const int *values = resolve(result, columns, first, registers);
+            std::copy(values, values + rows, out);
+        }
+    }
+
+    void evaluateRows(const int *const *columns, std::size_t rows, int *out) const {
+        std::vector<int> row(expression.inputSlots());
+        for (std::size_t r = 0; r < rows; r++) {
+            for (std::size_t slot = 0; slot < row.size(); slot++) {
+                row[slot] = columns[slot][r];
+            }
+            out[r] = expression(row.data());
+        }
+    }
+};
+
+constexpr std::size_t ColumnarExpression::blockRows;
+
+#ifdef __unix__
+
+// Read-only or read-write mapping of a whole file, unmapped on destruction.
+class MappedFile {
+private:
+    int fd = -1;
+    void *data = nullptr;
+    std::size_t length = 0;
+
+    [[noreturn]] static void fail(const std::string &path) {
+        throw std::system_error(errno, std::generic_category(), path);
+    }
+
+public:
+    // Maps an existing file for reading.
+    explicit MappedFile(const std::string &path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            fail(path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            fail(path);
+        }
+        length = static_cast<std::size_t>(info.st_size);
+        if (length > 0) {
+            data = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                fail(path);
+            }
+            ::madvise(data, length, MADV_SEQUENTIAL);
+        }
+    }
+
+    // Creates or truncates a file of the given length and maps it for writing.
+    MappedFile(const std::string &path, std::size_t length) : length(length) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fail(path);
+        }
+        if (::ftruncate(fd, static_cast<off_t>(length)) != 0) {
+            ::close(fd);
+            fail(path);
+        }
+        if (length > 0) {
+            data = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                fail(path);
+            }
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        if (data != nullptr) {
+            ::munmap(data, length);
+        }
+        ::close(fd);
+    }
+
+    std::size_t size() const {
+        return length;
+    }
+
+    int *ints() const {
+        return static_cast<int *>(data);
+    }
+
+    // Lets the kernel drop pages that will not be read again.
+    void release(std::size_t offset, std::size_t bytes) const {
+        if (data != nullptr) {
+            ::madvise(static_cast<char *>(data) + offset, bytes, MADV_DONTNEED);
+        }
+    }
+};
+
+// Evaluates an expression over files of native-endian int32 values, one file
+// per input slot, writing one int32 per row to outputPath. The files are
+// memory-mapped and streamed through in chunks, so they may exceed RAM.
+inline void evaluateColumnFiles(const ColumnarExpression &expression,
+                                const std::vector<std::string> &inputPaths,
+                                const std::string &outputPath) {
+    static_assert(sizeof(int) == 4, "column files hold int32 values");
+    // A multiple of the page size, so processed input pages can be released.
+    const std::size_t chunkRows = std::size_t(1) << 20;
+
+    if (inputPaths.size() < expression.inputSlots()) {
+        throw UnboundInput();
+    }
+    if (inputPaths.empty()) {
+        throw std::invalid_argument("Row count is unknown without input columns");
+    }
+    std::vector<std::unique_ptr<MappedFile>> inputs;
+    for (const std::string &path : inputPaths) {
+        inputs.emplace_back(new MappedFile(path));
+    }
+    std::size_t rows = inputs.front()->size() / sizeof(int);
+    for (const std::unique_ptr<MappedFile> &input : inputs) {
+        if (input->size() != rows * sizeof(int)) {
+            throw std::invalid_argument("Input column files differ in length");
+        }
+    }
+
+    MappedFile output(outputPath, rows * sizeof(int));
+    std::vector<const int *> columns(inputs.size());
+    for (std::size_t first = 0; first < rows; first += chunkRows) {
+        std::size_t count = std::min(chunkRows, rows - first);
+        for (std::size_t i = 0; i < inputs.size(); i++) {
+            columns[i] = inputs[i]->ints() + first;
+        }
+        expression.evaluate(columns.data(), count, output.ints() + first);
+        for (const std::unique_ptr<MappedFile> &input : inputs) {
+            input->release(first * sizeof(int), count * sizeof(int));
+        }
+    }
+}
+
+#endif
+
+#if defined(__x86_64__) && defined(__unix__)
+#define LAZY_CALCULATOR_JIT 1
+#endif
+
+// Prepared expression compiled to x86-64 machine code. Literals, inputs and
+// the built-in arithmetic become native instructions working on the machine
+// stack; every other operator node is a call back into the interpreter for
+// that node alone. Where native code cannot be generated the interpreter
+// runs the whole expression. Callable as a Lazy when it has no inputs.
+class NativeExpression {
+public:
+    explicit NativeExpression(PreparedExpression expression) : expression(std::move(expression)) {
+#ifdef LAZY_CALCULATOR_JIT
+        compile();
+#endif
+    }
+
+    bool compiled() const {
+        return entry != nullptr;
+    }
+
+    int operator()() const {
+        return (*this)(nullptr);
+    }
+
+    int operator()(const int *inputs) const {
+        if (entry == nullptr) {
+            return expression(inputs);
+        }
+        if (readsInputs && inputs == nullptr) {
+            throw UnboundInput();
+        }
+        Context context{0, &expression.expressionPlan(), nullptr};
+        int result = entry(&context, inputs);
+        if (context.failed) {
+            std::rethrow_exception(context.error);
+        }
+        return result;
+    }
+
+private:
+    using Index = ExpressionPlan::Index;
+    using Node = ExpressionPlan::Node;
+    using NodeKind = ExpressionPlan::NodeKind;
+
+    // Generated code checks failed, at offset 0, after every interpreter call.
+    struct Context {
+        unsigned char failed;
+        const ExpressionPlan *plan;
+        std::exception_ptr error;
+    };
+
+    using Entry = int (*)(Context *, const int *);
+
+    // Deeper expressions would need too much of the machine stack.
+    static constexpr std::size_t maxDepth = 1u << 15;
+
+    PreparedExpression expression;
+    std::shared_ptr<void> code;
+    Entry entry = nullptr;
+    bool readsInputs = false;
+
+    // Called from generated code, so nothing may propagate out of it.
+    static int fallback(Context *context, std::uint32_t node, const int *inputs) noexcept {
+        try {
+            return context->plan->evaluateNode(node, inputs);
+        }
+        catch (...) {
+            context->error = std::current_exception();
+            context->failed = 1;
+            return 0;
+        }
+    }
+
+#ifdef LAZY_CALCULATOR_JIT
+    class Assembler {
+    public:
+        std::vector<std::uint8_t> bytes;
+
+        void emit(std::initializer_list<std::uint8_t> code) {
+            bytes.insert(bytes.end(), code);
+        }
+
+        void emit32(std::uint32_t value) {
+            for (int i = 0; i < 4; i++) {
+                bytes.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+            }
+        }
+
+        void emit64(std::uint64_t value) {
+            for (int i = 0; i < 8; i++) {
+                bytes.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+            }
+        }
+    };
+
+    static bool isArithmetic(char symbol) {
+        switch (symbol) {
+            case '+':
+            case '-':
+            case '*':
+            case '/':
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    void compile() {
+        static_assert(offsetof(Context, failed) == 0, "generated code reads failed at offset 0");
+        const ExpressionPlan &plan = expression.expressionPlan();
+        Assembler a;
+        std::vector<std::size_t> bailJumps;
+
+        a.emit({0x53});                   // push rbx
+        a.emit({0x41, 0x54});             // push r12
+        a.emit({0x55});                   // push rbp
+        a.emit({0x48, 0x89, 0xE5});       // mov rbp, rsp
+        a.emit({0x48, 0x89, 0xFB});       // mov rbx, rdi
+        a.emit({0x49, 0x89, 0xF4});       // mov r12, rsi
+
+        // Post-order walk of the native part of the tree, left to right, so
+        // interpreter calls happen in the same order as in the interpreter.
+        std::vector<std::pair<Index, bool>> work{{plan.root, false}};
+        std::size_t depth = 0;
+        while (!work.empty()) {
+            Index i = work.back().first;
+            bool expanded = work.back().second;
+            work.pop_back();
+            const Node &node = plan.nodes[i];
+            if (node.kind == NodeKind::Literal) {
+                a.emit({0x68});           // push imm32
+                a.emit32(static_cast<std::uint32_t>(node.value));
+                depth++;
+            } else if (node.kind == NodeKind::Input) {
+                a.emit({0x41, 0x8B, 0x84, 0x24}); // mov eax, [r12 + disp32]
+                a.emit32(static_cast<std::uint32_t>(node.value * sizeof(int)));
+                a.emit({0x50});           // push rax
+                readsInputs = true;
+                depth++;
+            } else if (isArithmetic(node.symbol)) {
+                if (!expanded && node.kind == NodeKind::Reduce) {
+                    for (Index k = node.right; k-- > 1;) {
+                        work.push_back({i, true});
+                        work.push_back({plan.operands[node.left + k], false});
+                    }
+                    work.push_back({plan.operands[node.left], false});
+                    continue;
+                }
+                if (!expanded) {
+                    work.push_back({i, true});
+                    work.push_back({node.right, false});
+                    work.push_back({node.left, false});
+                    continue;
+                }
+                a.emit({0x59});           // pop rcx
+                a.emit({0x58});           // pop rax
+                switch (node.symbol) {
+                    case '+': a.emit({0x01, 0xC8}); break;       // add eax, ecx
+                    case '-': a.emit({0x29, 0xC8}); break;       // sub eax, ecx
+                    case '*': a.emit({0x0F, 0xAF, 0xC1}); break; // imul eax, ecx
+                    default: a.emit({0x99, 0xF7, 0xF9}); break;  // cdq; idiv ecx
+                }
+                a.emit({0x50});           // push rax
+                depth--;
+            } else {
+                bool misaligned = depth % 2 != 0;
+                if (misaligned) {
+                    a.emit({0x48, 0x83, 0xEC, 0x08}); // sub rsp, 8
+                }
+                a.emit({0x48, 0x89, 0xDF});       // mov rdi, rbx
+                a.emit({0xBE});                   // mov esi, imm32
+                a.emit32(i);
+                a.emit({0x4C, 0x89, 0xE2});       // mov rdx, r12
+                a.emit({0x48, 0xB8});             // mov rax, imm64
+                a.emit64(reinterpret_cast<std::uint64_t>(&NativeExpression::fallback));
+                a.emit({0xFF, 0xD0});             // call rax
+                if (misaligned) {
+                    a.emit({0x48, 0x83, 0xC4, 0x08}); // add rsp, 8
+                }
+                a.emit({0x80, 0x3B, 0x00});       // cmp byte [rbx], 0
+                a.emit({0x0F, 0x85});             // jne bail
+                bailJumps.push_back(a.bytes.size());
+                a.emit32(0);
+                a.emit({0x50});                   // push rax
+                depth++;
+            }
+            if (depth > maxDepth) {
+                return;
+            }
+        }
+
+        a.emit({0x58});                   // pop rax
+        a.emit({0x5D});                   // pop rbp
+        a.emit({0x41, 0x5C});             // pop r12
+        a.emit({0x5B});                   // pop rbx
+        a.emit({0xC3});                   // ret
+        std::size_t bail = a.bytes.size();
+        a.emit({0x48, 0x89, 0xEC});       // mov rsp, rbp
+        a.emit({0x5D});                   // pop rbp
+        a.emit({0x41, 0x5C});             // pop r12
+        a.emit({0x5B});                   // pop rbx
+        a.emit({0x31, 0xC0});             // xor eax, eax
+        a.emit({0xC3});                   // ret
+        for (std::size_t at : bailJumps) {
+            auto relative = static_cast<std::uint32_t>(bail - (at + 4));
+            std::memcpy(&a.bytes[at], &relative, sizeof(relative));
+        }
+
+        std::size_t length = a.bytes.size();
+        void *memory = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return;
+        }
+        code = std::shared_ptr<void>(memory, [length](void *p) { ::munmap(p, length); });
+        std::memcpy(memory, a.bytes.data(), length);
+        if (::mprotect(memory, length, PROT_READ | PROT_EXEC) != 0) {
+            code.reset();
+            return;
+        }
+        entry = reinterpret_cast<Entry>(memory);
+    }
+#endif
+};
+
+constexpr std::size_t NativeExpression::maxDepth;
+
+enum class EvictionPolicy {
+    LeastRecentlyUsed,
+    FirstInFirstOut
+};
+
+struct CacheOptions {
+    std::size_t capacity = 1024; // Zero disables caching.
+    std::size_t shards = 16;
+    EvictionPolicy eviction = EvictionPolicy::LeastRecentlyUsed;
+};
+
+// Cache entry: a parsed plan plus its execution tier. The plan is used until
+// the entry has been hit often enough to be worth compiling to native code,
+// which then replaces it atomically.
+class CachedExpression {
+private:
+    std::atomic<std::shared_ptr<const NativeExpression>> optimized;
+
+public:
+    const std::shared_ptr<const ExpressionPlan> plan;
+    std::atomic<std::uint32_t> hits{0};
+
+    explicit CachedExpression(std::shared_ptr<const ExpressionPlan> plan) : plan(std::move(plan)) {
+    }
+
+    std::shared_ptr<const NativeExpression> native() const {
+        return optimized.load();
+    }
+
+    void promote(std::shared_ptr<const NativeExpression> native) {
+        optimized.store(std::move(native));
+    }
+};
+
+// Bounded map from expression text to its parsed plan. Keys are spread over
+// independently locked shards so concurrent callers rarely contend. The
+// capacity is split between the shards exactly, so there are never more
+// shards than entries allowed.
+class PlanCache {
+private:
+    using Plan = std::shared_ptr<CachedExpression>;
+    using Order = std::list<std::pair<std::string, Plan>>;
+
+    struct Shard {
+        std::mutex mutex;
+        Order order; // Front is evicted first.
+        std::unordered_map<std::string, Order::iterator> index;
+        std::size_t capacity = 0;
+    };
+
+    std::vector<Shard> shards;
+    std::size_t capacity;
+    EvictionPolicy eviction;
+
+    Shard &shardOf(const std::string &s) {
+        return shards[std::hash<std::string>()(s) % shards.size()];
+    }
+
+public:
+    explicit PlanCache(const CacheOptions &options)
+            : shards(std::max<std::size_t>(std::min(options.shards, options.capacity), 1)),
+              capacity(options.capacity),
+              eviction(options.eviction) {
+        for (std::size_t i = 0; i < shards.size(); i++) {
+            shards[i].capacity = capacity / shards.size() + (i < capacity % shards.size() ? 1 : 0);
+        }
+    }
+
+    bool enabled() const {
+        return capacity > 0;
+    }
+
+    std::size_t size() {
+        std::size_t entries = 0;
+        for (Shard &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            entries += shard.order.size();
+        }
+        return entries;
+    }
+
+    Plan find(const std::string &s) {
+        Shard &shard = shardOf(s);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(s);
+        if (it == shard.index.end()) {
+            return nullptr;
+        }
+        if (eviction == EvictionPolicy::LeastRecentlyUsed) {
+            shard.order.splice(shard.order.end(), shard.order, it->second);
+        }
+        return it->second->second;
+    }
+
+    // Like find, but leaves the eviction order alone.
+    Plan peek(const std::string &s) {
+        Shard &shard = shardOf(s);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(s);
+        return it == shard.index.end() ? nullptr : it->second->second;
+    }
+
+    // Returns the entry that ends up cached, which is an earlier one if
+    // another thread inserted the same text first.
+    Plan insert(const std::string &s, Plan plan) {
+        Shard &shard = shardOf(s);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto existing = shard.index.find(s);
+        if (existing != shard.index.end()) {
+            return existing->second->second;
+        }
+        if (shard.capacity == 0) {
+            return plan;
+        }
+        if (shard.order.size() >= shard.capacity) {
+            shard.index.erase(shard.order.front().first);
+            shard.order.pop_front();
+        }
+        shard.order.emplace_back(s, std::move(plan));
+        shard.index.emplace(s, std::prev(shard.order.end()));
+        return shard.order.back().second;
+    }
+
+    void clear() {
+        for (Shard &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.index.clear();
+            shard.order.clear();
+        }
+    }
+};
+
+struct CalculatorOptions {
+    CacheOptions cache;
+    // Shared pure subtrees are evaluated at most once per calculate call.
+    bool evaluatePureSubtreesOnce = false;
+    // Runs calculateBatch and background compilation; created with one
+    // thread per core on first use when empty.
+    std::shared_ptr<WorkStealingPool> pool;
+    // Cached expressions calculated this many times are compiled to native
+    // code in the background. Zero keeps every expression interpreted.
+    std::uint32_t promotionThreshold = 0;
+    // Prepared expressions evaluate both operands of a pure strict operator
+    // on the pool when each spans at least this many nodes. Zero keeps
+    // evaluation on the calling thread.
+    std::size_t parallelThreshold = 0;
+};
+
+enum class ExecutionTier {
+    Uncached,
+    Interpreted,
+    Native
+};
+
+struct RealTimeLimits {
+    std::size_t maxTokens = 1024;
+    std::size_t maxDepth = 256;
+    std::size_t maxNodes = 1024;
+};
+
+// Parses and evaluates within a buffer allocated once, up front, for the
+// given limits; tryCalculate never reaches the global heap unless an operator
+// does. Expressions beyond the limits fail with CapacityExceeded. Uses the
+// operators defined when it was created and handles one call at a time.
+// Unlike everywhere else, operands live on the evaluating frame, so
+// operators must not keep them past their call.
+class RealTimeCalculator {
+private:
+    std::shared_ptr<const OperatorTable> operators;
+    RealTimeLimits limits;
+    bool memoizePure;
+    std::size_t bytes;
+    std::unique_ptr<std::byte[]> buffer;
+
+    // Upper bound on everything one calculate call takes from its arena.
+    // Vectors that grow by doubling are counted twice.
+    static std::size_t arenaBytes(const RealTimeLimits &limits) {
+        using Index = ExpressionPlan::Index;
+        constexpr std::size_t maxCopied = PlanBuilder::maxCopied;
+        std::size_t nodes = std::min(limits.maxNodes, limits.maxTokens);
+        return 4096 + 2 * sizeof(ExpressionPlan) + 2 * 256 * sizeof(const OperatorDefinition *)
+               + 2 * nodes * sizeof(ExpressionPlan::Node)                // Reserved once, shrunk once.
+               + 4 * limits.maxTokens * sizeof(Index)                    // Operand stack.
+               + 8 * (nodes + 4) * sizeof(Index)                         // Intern table and its rehashes.
+               + 8 * nodes * sizeof(Index)                               // Parents, work list, renumbering, depths.
+               + nodes * (sizeof(int) + 1)                               // Memo.
+               + 2 * (2 * maxCopied + 2) * limits.maxTokens * sizeof(Index) // Reduction operands.
+               + (2 * limits.maxDepth + 2) * (sizeof(ExpressionPlan::Frame) + sizeof(int));
+    }
+
+    CalculationStatus calculateInto(const std::string &s, int &result, const int *inputs) const {
+        if (s.size() > limits.maxTokens) {
+            return CalculationStatus::CapacityExceeded;
+        }
+        // Anything past the buffer is a bug in arenaBytes, never a heap allocation.
+        std::pmr::monotonic_buffer_resource arena(buffer.get(), bytes, std::pmr::null_memory_resource());
+        PlanBuilder builder(operators, std::min(s.size(), limits.maxNodes), memoizePure, &arena);
+        builder.limitNodes(limits.maxNodes);
+        bool mentionsInput = false;
+        for (char c : s) {
+            mentionsInput = mentionsInput || operators->inputSlot(c) >= 0;
+            CalculationStatus status = builder.tryPush(c);
+            if (status != CalculationStatus::Ok) {
+                return status;
+            }
+        }
+        std::shared_ptr<const ExpressionPlan> plan;
+        CalculationStatus status = builder.tryFinish(plan);
+        if (status != CalculationStatus::Ok) {
+            return status;
+        }
+        if (plan->depth() > limits.maxDepth) {
+            return CalculationStatus::CapacityExceeded;
+        }
+        if (mentionsInput && inputs == nullptr) {
+            return CalculationStatus::UnboundInput;
+        }
+        result = plan->evaluateNode(plan->root, inputs, &arena, false);
+        return CalculationStatus::Ok;
+    }
+
+public:
+    RealTimeCalculator(std::shared_ptr<const OperatorTable> operators, const RealTimeLimits &limits,
+                       bool memoizePure = false)
+            : operators(std::move(operators)), limits(limits), memoizePure(memoizePure),
+              bytes(arenaBytes(limits)), buffer(new std::byte[bytes]) {}
+
+    // Errors are returned rather than thrown, as throwing allocates. Operator
+    // exceptions cannot be reported here, so operators must not throw. An
+    // expression that mentions an input fails with UnboundInput without
+    // inputs, whether or not the input is read.
+    CalculationStatus tryCalculate(const std::string &s, int &result, const int *inputs = nullptr) const noexcept {
+        return calculateInto(s, result, inputs);
+    }
+
+    int calculate(const std::string &s, const int *inputs = nullptr) const {
+        int result = 0;
+        throwIfFailed(calculateInto(s, result, inputs));
+        return result;
+    }
+
+    const RealTimeLimits &capacity() const {
+        return limits;
+    }
+};
+
+class LazyCalculator {
+private:
+    std::shared_ptr<OperatorTable> definedOperators;
+    std::unique_ptr<PlanCache> cache;
+    mutable CalculatorOptions options;
+    // Guards options.pool, which is created on first use.
+    mutable std::mutex poolMutex;
+
+    // The compiled code only replaces the plan when it really is native.
+    void promote(std::shared_ptr<CachedExpression> cached) const {
+        workerPool().submit([cached]() {
+            auto native = std::make_shared<const NativeExpression>(PreparedExpression(cached->plan));
+            if (native->compiled()) {
+                cached->promote(std::move(native));
+            }
+        });
+    }
+
+    // Reduces the text on a value stack in one pass when every operator in it
+    // is strict, in which case postfix order is exactly evaluation order and
+    // no plan is needed. Anything else, malformed input included, is left to
+    // the plan: the check runs first, so nothing has been evaluated then.
+    bool calculateStrict(const std::string &s, int &result,
+                         std::pmr::memory_resource *resource = std::pmr::get_default_resource()) const {
+        const OperatorTable &operators = *definedOperators;
+        std::size_t depth = 0;
+        std::size_t maxDepth = 0;
+        for (char c : s) {
+            if (isLiteral(c)) {
+                maxDepth = std::max(maxDepth, ++depth);
+                continue;
+            }
+            const OperatorDefinition *op = operators.find(c);
+            if (op == nullptr || !hasFlags(op->flags, OperatorFlags::Strict) || depth < 2) {
+                return false;
+            }
+            depth--;
+        }
+        if (depth != 1) {
+            return false;
+        }
+        int shallow[64];
+        std::pmr::vector<int> deep(resource);
+        int *stack = shallow;
+        if (maxDepth > 64) {
+            deep.resize(maxDepth);
+            stack = deep.data();
+        }
+        std::size_t top = 0;
+        for (char c : s) {
+            if (isLiteral(c)) {
+                stack[top++] = c - '0';
+                continue;
+            }
+            top--;
+            stack[top - 1] = applyStrict(*operators.find(c), stack[top - 1], stack[top]);
+        }
+        result = stack[0];
+        return true;
+    }
+
+    std::shared_ptr<WorkStealingPool> sharedPool() const {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        if (!options.pool) {
+            options.pool = std::make_shared<WorkStealingPool>();
+        }
+        return options.pool;
+    }
+
+    // Once created, the pool stays for as long as the calculator.
+    WorkStealingPool &workerPool() const {
+        return *sharedPool();
+    }
+
+    CalculatorOptions currentOptions() const {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        return options;
+    }
+public:
+    std::shared_ptr<const ExpressionPlan> buildPlan(
+            const std::string &s, std::pmr::memory_resource *resource = std::pmr::get_default_resource()) const {
+        PlanBuilder builder(definedOperators, s.size(), options.evaluatePureSubtreesOnce, resource);
+        for (char c : s) {
+            builder.push(c);
+        }
+        return builder.finish();
+    }
+
+    // Snapshot of the current operators for allocation-free calculation.
+    RealTimeCalculator realTime(const RealTimeLimits &limits = {}) const {
+        return RealTimeCalculator(definedOperators, limits, options.evaluatePureSubtreesOnce);
+    }
+
+    std::shared_ptr<const BytecodeProgram> compile(const std::string &s) const {
+        return BytecodeCompiler(*buildPlan(s)).compile();
+    }
+
+    IncrementalParser incrementalParser() const {
+        return IncrementalParser(PlanBuilder(definedOperators, 0, options.evaluatePureSubtreesOnce));
+    }
+
+    // Cache entry for the text, parsing it on a miss; null when caching is off.
+    std::shared_ptr<CachedExpression> cachedExpression(const std::string &s) const {
+        if (!cache->enabled()) {
+            return nullptr;
+        }
+        std::shared_ptr<CachedExpression> cached = cache->find(s);
+        if (!cached) {
+            cached = cache->insert(s, std::make_shared<CachedExpression>(buildPlan(s)));
+        }
+        return cached;
+    }
+
+    // Like buildPlan, but served from the cache when the text was seen before.
+    std::shared_ptr<const ExpressionPlan> plan(const std::string &s) const {
+        std::shared_ptr<CachedExpression> cached = cachedExpression(s);
+        return cached ? cached->plan : buildPlan(s);
+    }
+
+    ExecutionTier tierOf(const std::string &s) const {
+        std::shared_ptr<CachedExpression> cached = cache->enabled() ? cache->peek(s) : nullptr;
+        if (!cached) {
+            return ExecutionTier::Uncached;
+        }
+        return cached->native() ? ExecutionTier::Native : ExecutionTier::Interpreted;
+    }
+
+    PreparedExpression prepare(const std::string &s) const {
+        if (options.parallelThreshold > 0) {
+            return PreparedExpression(plan(s), sharedPool(), options.parallelThreshold);
+        }
+        return PreparedExpression(plan(s));
+    }
+
+    // Machine code for the expression, see NativeExpression.
+    NativeExpression compileNative(const std::string &s) const {
+        return NativeExpression(prepare(s));
+    }
+
+    // Converts to Lazy where one is needed.
+    InlineLazy parse(const std::string &s) const {
+        std::shared_ptr<const ExpressionPlan> parsed = plan(s);
+        return [parsed]() { return parsed->evaluate(); };
+    }
+
+    // The plan, every evaluation of it and every operand an operator keeps
+    // live in the arena, which must outlive all of them. Bypasses the cache,
+    // so releasing the arena frees everything the expression ever allocated.
+    InlineLazy parse(const std::string &s, std::pmr::memory_resource *arena) const {
+        std::shared_ptr<const ExpressionPlan> parsed = buildPlan(s, arena);
+        return [parsed, arena]() { return parsed->evaluate(nullptr, arena); };
+    }
+
+    int calculate(const std::string &s, std::pmr::memory_resource *arena) const {
+        int result;
+        if (calculateStrict(s, result, arena)) {
+            return result;
+        }
+        return buildPlan(s, arena)->evaluate(nullptr, arena);
+    }
+
+    // Expressions of strict operators only are reduced as they are read,
+    // without looking at the cache, unless hot expressions are promoted:
+    // those are exactly what compiles to native code, so they are cached
+    // and counted like any other.
+    int calculate(const std::string &s) const {
+        int result;
+        if (options.promotionThreshold == 0 && calculateStrict(s, result)) {
+            return result;
+        }
+        std::shared_ptr<CachedExpression> cached = cachedExpression(s);
+        if (!cached) {
+            return buildPlan(s)->evaluate();
+        }
+        std::shared_ptr<const NativeExpression> native = cached->native();
+        if (native) {
+            return (*native)();
+        }
+        if (options.promotionThreshold > 0 && ++cached->hits == options.promotionThreshold) {
+            promote(cached);
+        }
+        return cached->plan->evaluate();
+    }
+
+    // Calculates every expression on the worker pool. Operators may be called
+    // from several threads at once. Errors are reported per expression.
+    std::vector<BatchResult> tryCalculateBatch(const std::string *expressions, std::size_t count) const {
+        std::vector<BatchResult> results(count);
+        WorkStealingPool &workers = workerPool();
+        TaskGroup group(workers);
+        std::size_t grain = std::max<std::size_t>(1, count / (8 * workers.size()));
+        // Halves of the range are left for idle workers to steal.
+        std::function<void(std::size_t, std::size_t)> process = [&](std::size_t first, std::size_t last) {
+            while (last - first > grain) {
+                std::size_t middle = first + (last - first) / 2;
+                group.run([&process, middle, last]() { process(middle, last); });
+                last = middle;
+            }
+            for (std::size_t i = first; i < last; i++) {
+                try {
+                    results[i].value = calculate(expressions[i]);
+                }
+                catch (...) {
+                    results[i].error = std::current_exception();
+                }
+            }
+        };
+        process(0, count);
+        group.wait();
+        return results;
+    }
+
+    // Vectors and arrays of strings convert to the span.
+    std::vector<BatchResult> tryCalculateBatch(std::span<const std::string> expressions) const {
+        return tryCalculateBatch(expressions.data(), expressions.size());
+    }
+
+    // Like tryCalculateBatch, but rethrows the error of the first failed expression.
+    std::vector<int> calculateBatch(const std::string *expressions, std::size_t count) const {
+        std::vector<int> values;
+        values.reserve(count);
+        for (const BatchResult &result : tryCalculateBatch(expressions, count)) {
+            if (result.error) {
+                std::rethrow_exception(result.error);
+            }
+            values.push_back(result.value);
+        }
+        return values;
+    }
+
+    std::vector<int> calculateBatch(std::span<const std::string> expressions) const {
+        return calculateBatch(expressions.data(), expressions.size());
+    }
+
+    void define(char c, std::function<int(Lazy, Lazy)> fn, OperatorFlags flags = OperatorFlags::None) {
+        OperatorDefinition single{c, std::move(fn), flags};
+        define(&single, &single + 1);
+    }
+
+    // Registers a whole range of OperatorDefinitions at once. Either all of
+    // them are defined or, if any character is taken, none is.
+    template<typename Iterator>
+    void define(Iterator first, Iterator last) {
+        bool taken[256] = {};
+        for (Iterator it = first; it != last; ++it) {
+            auto c = static_cast<unsigned char>(it->symbol);
+            if (taken[c] || definedOperators->defined(it->symbol)) {
+                throw OperatorAlreadyDefined();
+            }
+            taken[c] = true;
+        }
+
+        // Plans still referencing the current table must not see it change.
+        if (definedOperators.use_count() != 1) {
+            definedOperators = std::make_shared<OperatorTable>(*definedOperators);
+        }
+        for (Iterator it = first; it != last; ++it) {
+            definedOperators->insert(*it);
+        }
+        // Cached plans were built against the previous set of operators.
+        cache->clear();
+    }
+
+    void define(std::initializer_list<OperatorDefinition> operators) {
+        define(operators.begin(), operators.end());
+    }
+
+    // Reserves c as an input slot of prepared expressions and returns the
+    // slot's index. Slots are numbered in the order they are defined.
+    int defineInput(char c) {
+        if (definedOperators->defined(c)) {
+            throw OperatorAlreadyDefined();
+        }
+        if (definedOperators.use_count() != 1) {
+            definedOperators = std::make_shared<OperatorTable>(*definedOperators);
+        }
+        int slot = definedOperators->insertInput(c);
+        cache->clear();
+        return slot;
+    }
+
+    explicit LazyCalculator(const CalculatorOptions &options = CalculatorOptions())
+            : definedOperators(std::make_shared<OperatorTable>()),
+              cache(new PlanCache(options.cache)),
+              options(options) {
+        NativeStack::prepare();
+        const OperatorFlags arithmetic = OperatorFlags::Pure | OperatorFlags::Strict;
+        const OperatorFlags group = arithmetic | OperatorFlags::Associative | OperatorFlags::Commutative;
+        define('+', [](Lazy a, Lazy b) { return a() + b(); }, group);
+        define('-', [](Lazy a, Lazy b) { return a() - b(); }, arithmetic);
+        define('*', [](Lazy a, Lazy b) { return a() * b(); }, group);
+        define('/', [](Lazy a, Lazy b) { return a() / b(); }, arithmetic);
+
+        define('0', [](Lazy a, Lazy b) { return a() + b(); });
+        define('2', [](Lazy a, Lazy b) { return a() + b(); });
+        define('4', [](Lazy a, Lazy b) { return a() + b(); });
+    }
+
+    // Copies share the operator table until either side defines something,
+    // and the worker pool; each starts with an empty cache of its own.
+    LazyCalculator(const LazyCalculator &other)
+            : definedOperators(other.definedOperators),
+              cache(new PlanCache(other.options.cache)),
+              options(other.currentOptions()) {
+    }
+
+    LazyCalculator &operator=(const LazyCalculator &other) {
+        if (this != &other) {
+            CalculatorOptions copied = other.currentOptions();
+            definedOperators = other.definedOperators;
+            cache.reset(new PlanCache(copied.cache));
+            std::lock_guard<std::mutex> lock(poolMutex);
+            // A pool already created here stays when the other has none yet.
+            if (!copied.pool) {
+                copied.pool = options.pool;
+            }
+            options = std::move(copied);
+        }
+        return *this;
+    }
+};
+
+// Expression text usable as a template argument, e.g. static_calculate<"42+">().
+template<std::size_t N>
+struct FixedString {
+    char text[N] = {};
+
+    constexpr FixedString(const char (&s)[N]) {
+        std::copy_n(s, N, text);
+    }
+
+    constexpr std::size_t size() const {
+        return N - 1;
+    }
+
+    constexpr char operator[](std::size_t i) const {
+        return text[i];
+    }
+};
+
+// Operator fixed at compile time. Fn must be default constructible, e.g. a
+// captureless lambda, and accept its operands as generic thunks:
+// StaticOperator<'!', decltype([](auto a, auto b) { return a() * 10 + b(); })>.
+template<char Symbol, typename Fn>
+struct StaticOperator {
+    static constexpr char symbol = Symbol;
+
+    template<typename A, typename B>
+    constexpr int operator()(A a, B b) const {
+        return Fn{}(a, b);
+    }
+};
+
+namespace static_operators {
+
+struct Add {
+    template<typename A, typename B>
+    constexpr int operator()(A a, B b) const { return a() + b(); }
+};
+
+struct Subtract {
+    template<typename A, typename B>
+    constexpr int operator()(A a, B b) const { return a() - b(); }
+};
+
+struct Multiply {
+    template<typename A, typename B>
+    constexpr int operator()(A a, B b) const { return a() * b(); }
+};
+
+struct Divide {
+    template<typename A, typename B>
+    constexpr int operator()(A a, B b) const { return a() / b(); }
+};
+
+} // namespace static_operators
+
+// The built-in arithmetic plus Ops, known at compile time. Looking an
+// operator up is a table load and applying it is a call picked by a
+// constant index, with no type erasure in between.
+template<typename... Ops>
+class StaticOperatorSet {
+public:
+    using Operators = std::tuple<StaticOperator<'+', static_operators::Add>,
+                                 StaticOperator<'-', static_operators::Subtract>,
+                                 StaticOperator<'*', static_operators::Multiply>,
+                                 StaticOperator<'/', static_operators::Divide>,
+                                 Ops...>;
+
+    static constexpr std::size_t size = std::tuple_size_v<Operators>;
+
+    // Index into Operators, or -1 when c is not an operator.
+    static constexpr int indexOf(char c) {
+        return indices[static_cast<unsigned char>(c)];
+    }
+
+    template<typename A, typename B>
+    static constexpr int apply(int op, A a, B b) {
+        return apply(std::make_index_sequence<size>(), op, a, b);
+    }
 
-class LazyCalculator {
-private:
-    std::unordered_map<char, std::function<int(Lazy, Lazy)>> definedOperators;
-public:
-    Lazy parse(const std::string &s) const {
-        std::stack<Lazy> stackOfLazy;
-        for (char c : s) {
-            if (c == '2' || c == '4' || c == '0') {
-                Lazy l = [c]() { return c - '0'; };
-                stackOfLazy.push(l);
+    struct Node {
+        int op; // Index into Operators, -1 for a literal.
+        int value;
+        int left;
+        int right;
+    };
+
+    // Parses the text into nodes, one per character at the same index, and
+    // returns the index of the root. Both nodes and stack must have room for
+    // every character. Used at compile time and at run time alike.
+    template<typename Text, typename Nodes, typename Stack>
+    static constexpr int parse(const Text &text, Nodes &nodes, Stack &stack) {
+        std::size_t depth = 0;
+        for (std::size_t i = 0; i < text.size(); i++) {
+            char c = text[i];
+            if (isLiteral(c)) {
+                nodes[i] = {-1, c - '0', 0, 0};
             } else {
-                auto op = definedOperators.find(c);
-                if (op == definedOperators.end()) {
+                int op = indexOf(c);
+                if (op < 0) {
                     throw UnknownOperator();
                 }
-                if (stackOfLazy.size() < 2) {
+                if (depth < 2) {
                     throw SyntaxError();
                 }
-                Lazy a = stackOfLazy.top();
-                stackOfLazy.pop();
-                Lazy b = stackOfLazy.top();
-                stackOfLazy.pop();
-                auto f = std::bind(definedOperators.at(c), b, a);
-                stackOfLazy.push(static_cast<Lazy>(f));
+                int a = stack[--depth];
+                int b = stack[--depth];
+                nodes[i] = {op, 0, b, a};
             }
+            stack[depth++] = static_cast<int>(i);
         }
-        if (stackOfLazy.size() != 1) {
+        if (depth != 1) {
             throw SyntaxError();
         }
-        return stackOfLazy.top();
+        return stack[0];
     }
 
-    int calculate(const std::string &s) const {
-        return parse(s)();
+private:
+    static constexpr char symbols[] = {'+', '-', '*', '/', Ops::symbol...};
+
+    static constexpr std::array<std::int16_t, 256> indices = []() {
+        std::array<std::int16_t, 256> table{};
+        table.fill(-1);
+        for (std::size_t i = 0; i < std::size(symbols); i++) {
+            table[static_cast<unsigned char>(symbols[i])] = static_cast<std::int16_t>(i);
+        }
+        return table;
+    }();
+
+    static constexpr bool distinctSymbols() {
+        for (std::size_t i = 0; i < std::size(symbols); i++) {
+            if (isLiteral(symbols[i]) || indexOf(symbols[i]) != static_cast<int>(i)) {
+                return false;
+            }
+        }
+        return true;
     }
 
-    void define(char c, std::function<int(Lazy, Lazy)> fn) {
-        if (definedOperators.find(c) != definedOperators.end()) {
-            throw OperatorAlreadyDefined();
+    static_assert(distinctSymbols(), "Operator is already defined");
+
+    template<std::size_t... I, typename A, typename B>
+    static constexpr int apply(std::index_sequence<I...>, int op, A a, B b) {
+        int result = 0;
+        (void) ((op == static_cast<int>(I) ? (result = std::tuple_element_t<I, Operators>{}(a, b), true) : false)
+                || ...);
+        return result;
+    }
+};
+
+// Calculator whose operators, the built-in arithmetic plus Ops, are fixed at
+// compile time. Expressions given as template arguments are parsed during
+// compilation, and evaluation is a tree of direct calls with the node index
+// in the type, so it folds to a constant whenever the operators allow and is
+// fully inlined otherwise. Syntax errors are compile errors.
+template<typename... Ops>
+class StaticCalculator {
+private:
+    using Set = StaticOperatorSet<Ops...>;
+    using Node = typename Set::Node;
+
+    template<std::size_t N>
+    struct Plan {
+        std::array<Node, N> nodes{};
+        int root = 0;
+    };
+
+    template<FixedString Text>
+    static constexpr Plan<Text.size()> parse() {
+        Plan<Text.size()> plan;
+        std::array<int, Text.size()> stack{};
+        plan.root = Set::parse(Text, plan.nodes, stack);
+        return plan;
+    }
+
+    template<FixedString Text>
+    static constexpr Plan<Text.size()> plan = parse<Text>();
+
+    template<FixedString Text, int I>
+    struct Thunk {
+        constexpr int operator()() const {
+            return evaluate<Text, I>();
+        }
+    };
+
+    template<FixedString Text, int I>
+    static constexpr int evaluate() {
+        constexpr Node node = plan<Text>.nodes[I];
+        if constexpr (node.op < 0) {
+            return node.value;
+        } else {
+            using Op = std::tuple_element_t<node.op, typename Set::Operators>;
+            return Op{}(Thunk<Text, node.left>{}, Thunk<Text, node.right>{});
         }
+    }
 
-        definedOperators.insert({c, fn});
+public:
+    template<FixedString Text>
+    static constexpr int calculate() {
+        return evaluate<Text, plan<Text>.root>();
     }
+};
 
-    LazyCalculator() {
-        define('+', [](Lazy a, Lazy b) { return a() + b(); });
-        define('-', [](Lazy a, Lazy b) { return a() - b(); });
-        define('*', [](Lazy a, Lazy b) { return a() * b(); });
-        define('/', [](Lazy a, Lazy b) { return a() / b(); });
+template<FixedString Text, typename... Ops>
+constexpr int static_calculate() {
+    return StaticCalculator<Ops...>::template calculate<Text>();
+}
 
-        define('0', [](Lazy a, Lazy b) { return a() + b(); });
-        define('2', [](Lazy a, Lazy b) { return a() + b(); });
-        define('4', [](Lazy a, Lazy b) { return a() + b(); });
+// Runtime counterpart of StaticCalculator with the same parse and calculate
+// interface as LazyCalculator, for deployments that never call define.
+// Operators receive lightweight thunk objects; those taking Lazy still work,
+// the thunks convert to it.
+template<typename... Ops>
+class BasicLazyCalculator {
+private:
+    using Set = StaticOperatorSet<Ops...>;
+    using Node = typename Set::Node;
+
+    struct Plan {
+        std::vector<Node> nodes;
+        int root = 0;
+    };
+
+    struct Thunk {
+        const Plan *plan;
+        int node;
+
+        int operator()() const {
+            return evaluate(*plan, node);
+        }
+    };
+
+    static int evaluate(const Plan &plan, int i) {
+        const Node &node = plan.nodes[i];
+        if (node.op < 0) {
+            return node.value;
+        }
+        return Set::apply(node.op, Thunk{&plan, node.left}, Thunk{&plan, node.right});
+    }
+
+    static Plan buildPlan(const std::string &s) {
+        Plan plan;
+        plan.nodes.resize(s.size());
+        std::vector<int> stack(s.size());
+        plan.root = Set::parse(s, plan.nodes, stack);
+        return plan;
+    }
+
+public:
+    InlineLazy parse(const std::string &s) const {
+        auto plan = std::make_shared<const Plan>(buildPlan(s));
+        return [plan]() { return evaluate(*plan, plan->root); };
+    }
+
+    int calculate(const std::string &s) const {
+        Plan plan = buildPlan(s);
+        return evaluate(plan, plan.root);
     }
 };
 
@@ -90,6 +3444,185 @@ int manytimes(Lazy n, Lazy fn) {
     return 0;
 }
 
+// Counts global heap allocations so tests can check code paths that must not
+// make any. Only built with LAZY_CALCULATOR_COUNT_ALLOCATIONS defined, as it
+// replaces the allocator for the whole program; otherwise the count stays
+// zero. Every replaceable form is covered; allocation and release stay out of
+// line so the compiler never pairs a new expression with free(). On glibc the
+// C allocation functions are replaced as well, so allocations of the C and
+// C++ runtimes, thrown exceptions included, count too.
+std::atomic<std::size_t> heapAllocations{0};
+
+#ifdef LAZY_CALCULATOR_COUNT_ALLOCATIONS
+inline void countAllocation() noexcept {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Sanitizers replace the C allocation functions themselves.
+#if defined(__GLIBC__) && !defined(LAZY_CALCULATOR_ASAN) && !defined(LAZY_CALCULATOR_TSAN)
+#define LAZY_CALCULATOR_COUNT_MALLOC 1
+
+extern "C" {
+void *__libc_malloc(std::size_t size);
+void *__libc_calloc(std::size_t count, std::size_t size);
+void *__libc_realloc(void *p, std::size_t size);
+void *__libc_memalign(std::size_t alignment, std::size_t size);
+void *__libc_valloc(std::size_t size);
+void *__libc_pvalloc(std::size_t size);
+
+void *malloc(std::size_t size) noexcept {
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(std::size_t count, std::size_t size) noexcept {
+    countAllocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, std::size_t size) noexcept {
+    countAllocation();
+    return __libc_realloc(p, size);
+}
+
+void *aligned_alloc(std::size_t alignment, std::size_t size) noexcept {
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *memalign(std::size_t alignment, std::size_t size) noexcept {
+    countAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **p, std::size_t alignment, std::size_t size) noexcept {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+    countAllocation();
+    void *allocated = __libc_memalign(alignment, size);
+    if (allocated == nullptr) {
+        return ENOMEM;
+    }
+    *p = allocated;
+    return 0;
+}
+
+void *valloc(std::size_t size) noexcept {
+    countAllocation();
+    return __libc_valloc(size);
+}
+
+void *pvalloc(std::size_t size) noexcept {
+    countAllocation();
+    return __libc_pvalloc(size);
+}
+}
+#endif
+
+[[gnu::noinline]] void *countedAllocate(std::size_t size, std::size_t alignment) noexcept {
+#ifndef LAZY_CALCULATOR_COUNT_MALLOC
+    countAllocation();
+#endif
+    size = std::max<std::size_t>(size, 1);
+    if (alignment <= alignof(std::max_align_t)) {
+        return std::malloc(size);
+    }
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+[[gnu::noinline]] void countedRelease(void *p) noexcept {
+    std::free(p);
+}
+
+void *countedAllocateOrThrow(std::size_t size, std::size_t alignment) {
+    if (void *p = countedAllocate(size, alignment)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size) {
+    return countedAllocateOrThrow(size, 0);
+}
+
+void *operator new[](std::size_t size) {
+    return countedAllocateOrThrow(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    return countedAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return countedAllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, 0);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return countedAllocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept {
+    countedRelease(p);
+}
+
+void operator delete[](void *p) noexcept {
+    countedRelease(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    countedRelease(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept {
+    countedRelease(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    countedRelease(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    countedRelease(p);
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+    countedRelease(p);
+}
+
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept {
+    countedRelease(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    countedRelease(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    countedRelease(p);
+}
+
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+    countedRelease(p);
+}
+
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+    countedRelease(p);
+}
+#endif
+
 int main() {
     LazyCalculator calculator;
 
@@ -107,6 +3640,179 @@ int main() {
     assert(calculator.calculate("242--") == 0);
     assert(calculator.calculate("22+2-2*2/0-") == 2);
 
+    // Expressions known at build time are calculated by the compiler.
+    static_assert(static_calculate<"42+2*">() == 12);
+    static_assert(static_calculate<"22+2-2*2/0-">() == 2);
+    using Concat = StaticOperator<'!', decltype([](auto a, auto b) { return a() * 10 + b(); })>;
+    using Guard = StaticOperator<'?', decltype([](auto a, auto b) { return a() ? b() : 0; })>;
+    static_assert(static_calculate<"42!", Concat, Guard>() == 42);
+    // Laziness survives: the division by zero is never evaluated.
+    static_assert(static_calculate<"040/?", Concat, Guard>() == 0);
+
+    // The same operators fixed at compile time, for expressions only known at runtime.
+    using One = StaticOperator<'1', decltype([](Lazy, Lazy) { return 1; })>;
+    BasicLazyCalculator<Concat, Guard, One> fixed;
+    assert(fixed.calculate("22+2-2*2/0-") == 2);
+    assert(fixed.calculate("42!") == 42);
+    assert(fixed.calculate("040/?") == 0);
+    assert(fixed.parse("0214!")() == 14);
+    for (auto bad: {"", "42", "4+", "424+"}) {
+        try {
+            fixed.calculate(bad);
+            assert(false);
+        }
+        catch (SyntaxError) {
+        }
+    }
+    try {
+        fixed.calculate("02&");
+        assert(false);
+    }
+    catch (UnknownOperator) {
+    }
+
+    // Operators may keep their operands and call them later.
+    {
+        LazyCalculator keeping;
+        Lazy saved;
+        keeping.define('S', [&saved](Lazy a, Lazy) {
+            saved = a;
+            return 0;
+        });
+        keeping.define('T', [&saved](Lazy a, Lazy) {
+            a();
+            return saved();
+        });
+        keeping.define('N', [&saved](Lazy a, Lazy) {
+            saved = a;
+            return a();
+        }, OperatorFlags::CallByNeed);
+        assert(keeping.calculate("42+0S") == 0);
+        assert(saved() == 6);
+        assert(keeping.calculate("42+0S0T") == 6);
+        assert(keeping.compile("24+0S")->run() == 0);
+        assert(saved() == 6);
+        int xSlot = keeping.defineInput('x');
+        Lazy byNeed;
+        {
+            std::vector<int> values(xSlot + 1, 5);
+            assert(keeping.prepare("x2+0N")(values.data()) == 7);
+            byNeed = saved;
+            assert(keeping.compile("x4+0S")->run(values.data()) == 0);
+        }
+        assert(byNeed() == 7 && saved() == 9);
+    }
+
+    // Copies share operators until one of them defines more.
+    {
+        LazyCalculator original;
+        original.define('!', [](Lazy a, Lazy b) { return a() * 10 + b(); });
+        LazyCalculator copy = original;
+        copy.define('&', [](Lazy a, Lazy) { return a(); });
+        assert(copy.calculate("42!") == 42 && copy.calculate("42&") == 4);
+        try {
+            original.calculate("42&");
+            assert(false);
+        }
+        catch (UnknownOperator) {
+        }
+        original = copy;
+        assert(original.calculate("42&") == 4);
+
+        // Returned by value from a factory, pool and all.
+        auto makeCalculator = []() {
+            LazyCalculator made;
+            made.define('!', [](Lazy a, Lazy b) { return a() * 10 + b(); });
+            made.calculateBatch(std::vector<std::string>{"42!"});
+            return made;
+        };
+        LazyCalculator made = makeCalculator();
+        assert(made.calculateBatch(std::vector<std::string>{"42!", "24!"}) == std::vector<int>({42, 24}));
+    }
+
+    // Parsed expressions own everything they need.
+    Lazy detached = LazyCalculator().parse("42+2*");
+    assert(detached() == 12);
+    // Without the conversion no std::function is involved at all.
+    InlineLazy inlined = calculator.parse("42-");
+    InlineLazy moved = std::move(inlined);
+    assert(!inlined && moved() == 2);
+    InlineLazy wrapped = detached;
+    assert(wrapped() == 12);
+    static_assert(!std::is_convertible_v<int, InlineLazy> && !std::is_convertible_v<std::string, InlineLazy>);
+    {
+        // Nothing may spill past the buffer into the heap.
+        std::array<std::byte, 1 << 14> buffer;
+        std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size(), std::pmr::null_memory_resource());
+        LazyCalculator arenaCalculator;
+        arenaCalculator.define('a', [](Lazy a, Lazy b) { return a() + b(); });
+        assert(arenaCalculator.calculate("42a2a4-", &arena) == 4);
+        InlineLazy inArena = arenaCalculator.parse("24a4+2a", &arena);
+        assert(inArena() == 12 && inArena() == 12);
+        // Operands kept by an operator stay valid after the call, in the arena.
+        Lazy kept;
+        arenaCalculator.define('k', [&kept](Lazy a, Lazy) {
+            kept = a;
+            return 0;
+        });
+        assert(arenaCalculator.calculate("42a0k", &arena) == 0);
+        assert(kept() == 6);
+        InlineLazy keeping = arenaCalculator.parse("24a4a0k", &arena);
+        assert(keeping() == 0 && kept() == 10);
+
+        RealTimeCalculator realTime = arenaCalculator.realTime({16, 4, 8});
+#ifdef LAZY_CALCULATOR_COUNT_ALLOCATIONS
+        std::size_t allocations = heapAllocations;
+        ::operator delete[](::operator new[](16));
+        ::operator delete(::operator new(16, std::align_val_t{64}), std::align_val_t{64});
+        assert(heapAllocations == allocations + 2);
+#ifdef LAZY_CALCULATOR_COUNT_MALLOC
+        allocations = heapAllocations;
+        std::free(std::realloc(std::calloc(2, 8), 32));
+        std::free(std::malloc(16));
+        void *aligned = nullptr;
+        int alignedStatus = posix_memalign(&aligned, 64, 16);
+        assert(alignedStatus == 0);
+        std::free(aligned);
+        std::free(memalign(64, 16));
+        std::free(valloc(16));
+        assert(heapAllocations == allocations + 6);
+#endif
+#endif
+        // Checked on a fresh thread, whose first operator call once looked up its stack.
+        std::thread([&realTime]() {
+            std::size_t before = heapAllocations;
+            int value = 0;
+            bool ok = realTime.tryCalculate("42a2a4-", value) == CalculationStatus::Ok && value == 4;
+            ok = ok && realTime.tryCalculate("24a4+2a", value) == CalculationStatus::Ok && value == 12;
+            // Failures are returned, not thrown.
+            ok = ok && realTime.tryCalculate("22a2a2a2a", value) == CalculationStatus::CapacityExceeded;
+            ok = ok && realTime.tryCalculate("24a42aa04a20aaa", value) == CalculationStatus::CapacityExceeded;
+            ok = ok && realTime.tryCalculate("4a", value) == CalculationStatus::SyntaxError;
+            ok = ok && realTime.tryCalculate("42&", value) == CalculationStatus::UnknownOperator;
+            assert(ok && heapAllocations == before);
+        }).join();
+        for (const char *tooBig : {"22a2a2a2a2a2a2a2a", "22a2a2a2a", "24a42aa04a20aaa"}) {
+            try {
+                realTime.calculate(tooBig);
+                assert(false);
+            }
+            catch (CapacityExceeded) {
+            }
+        }
+        assert(realTime.calculate("22a2a2a") == 8);
+    }
+    // Pure operators applied to literals are folded while parsing.
+    assert(calculator.buildPlan("42-2-")->size() == 1);
+    assert(calculator.buildPlan("42+2*")->size() == 1);
+    assert(calculator.buildPlan("40/")->size() == 3);
+    // Strict-only expressions are reduced while reading, without a plan.
+    std::string streamed = "42+2*4-2/";
+    std::size_t allocationsBefore = heapAllocations;
+    assert(calculator.calculate(streamed) == 4);
+    assert(heapAllocations == allocationsBefore);
+    assert(calculator.tierOf(streamed) == ExecutionTier::Uncached);
+
     // The fun.
     calculator.define('!', [](Lazy a, Lazy b) { return a() * 10 + b(); });
     assert(calculator.calculate("42!") == 42);
@@ -127,6 +3833,8 @@ int main() {
 
 
     assert(buffer.length() == 42 * std::string("pomidor").length());
+    // Repeated subtrees are stored once, yet still evaluated at every use.
+    assert(calculator.buildPlan("42P42P,42P42P,,")->size() == 5);
 
     std::string buffer2 = std::move(buffer);
     buffer.clear();
@@ -144,6 +3852,471 @@ int main() {
 
     calculator.define('1', [](Lazy, Lazy) { return 1; });
     assert(calculator.calculate("021") == 1);
+    // Operands an operator never reads are not kept in the plan.
+    calculator.define('U', [](Lazy, Lazy) { return 1; }, OperatorFlags::IgnoresLeft | OperatorFlags::IgnoresRight);
+    calculator.define('L', [](Lazy, Lazy b) { return b(); }, OperatorFlags::IgnoresLeft);
+    assert(calculator.buildPlan("42!42!!2!42P2!U")->size() == 2);
+    assert(calculator.buildPlan("42!42!!2!42P2!1")->size() > 2);
+    buffer.clear();
+    assert(calculator.calculate("42!42!!2!42P2!U") == 1 && buffer.empty());
+    assert(calculator.compile("42!42!!2!42P2!U")->run() == 1);
+    assert(calculator.calculate("42P42!L") == 42 && buffer.empty());
+
+    // The same expression fed in arbitrary chunks.
+    buffer.clear();
+    IncrementalParser chunked = calculator.incrementalParser();
+    const std::string pomidory = "42P42P42P,,42P,";
+    for (std::size_t i = 0; i < pomidory.size(); i += 4) {
+        chunked.feed(pomidory.substr(i, 4));
+    }
+    assert(chunked.finish()() == 0);
+    assert(buffer.length() == 4 * std::string("pomidor").length());
+    // Finishing starts over with the next expression.
+    assert(chunked.feed("42").feed("!").finish()() == 42);
+    try {
+        chunked.finish();
+        assert(false);
+    }
+    catch (SyntaxError) {
+    }
+    try {
+        calculator.incrementalParser().feed("42+2").finish();
+        assert(false);
+    }
+    catch (SyntaxError) {
+    }
+
+    // The bytecode path agrees with the interpreter, effects included.
+    for (auto expression: {"42+", "22+2-2*2/0-", "42!", "021", "042!42P$?", "42P42P,2+"}) {
+        buffer.clear();
+        int expected = calculator.calculate(expression);
+        std::string effects = buffer;
+        buffer.clear();
+        assert(calculator.compile(expression)->run() == expected);
+        assert(buffer == effects);
+    }
+    assert(calculator.compile("42-2-")->size() == 2);
+
+    // Sequencing operators run their chains as one loop, effects in order.
+    LazyCalculator scripted;
+    std::string trace;
+    scripted.define(';', [](Lazy a, Lazy b) {
+        a();
+        return b();
+    }, OperatorFlags::Sequencing);
+    scripted.define('e', [&trace](Lazy a, Lazy) {
+        trace += static_cast<char>('0' + a());
+        return a();
+    });
+    for (auto script : {"40e20e;00e;42e;", "40e20e00e42e;;;", "40e20e00e;42e;;"}) {
+        trace.clear();
+        assert(scripted.calculate(script) == 4);
+        assert(trace == "4204");
+        trace.clear();
+        assert(scripted.compile(script)->run() == 4);
+        assert(trace == "4204");
+        trace.clear();
+        assert(scripted.compileNative(script)() == 4);
+        assert(trace == "4204");
+        assert(scripted.buildPlan(script)->depth() == 3);
+    }
+    std::string script = "20e";
+    for (int i = 0; i < 100000; i++) {
+        script += "40e;";
+    }
+    trace.clear();
+    assert(scripted.calculate(script) == 4 && trace.size() == 100001);
+    assert(scripted.buildPlan(script)->size() == 6);
+
+    // Parsed plans are cached by their text and dropped on eviction or define.
+    CalculatorOptions tiny;
+    tiny.cache.capacity = 2;
+    tiny.cache.shards = 1;
+    LazyCalculator cached(tiny);
+    auto first = cached.plan("42+");
+    auto second = cached.plan("42-");
+    assert(cached.plan("42+") == first);
+    assert(cached.plan("42*") != first);
+    assert(cached.plan("42+") == first);
+    assert(cached.plan("42-") != second);
+    cached.define('!', [](Lazy a, Lazy b) { return a() * 10 + b(); });
+    assert(cached.plan("42+") != first);
+    assert(cached.calculate("42!") == 42);
+    // Asking for an expression's tier does not keep it cached.
+    LazyCalculator peeked(tiny);
+    peeked.plan("42+");
+    peeked.plan("42-");
+    assert(peeked.tierOf("42+") == ExecutionTier::Interpreted);
+    peeked.plan("42*");
+    assert(peeked.tierOf("42+") == ExecutionTier::Uncached);
+    // First in, first out evicts the oldest entry even if it was just used.
+    for (EvictionPolicy eviction : {EvictionPolicy::FirstInFirstOut, EvictionPolicy::LeastRecentlyUsed}) {
+        PlanCache ordered(CacheOptions{2, 1, eviction});
+        auto entry = std::make_shared<CachedExpression>(cached.buildPlan("42+"));
+        ordered.insert("A", entry);
+        ordered.insert("B", entry);
+        assert(ordered.find("A") == entry);
+        ordered.insert("C", entry);
+        assert((ordered.peek("A") == nullptr) == (eviction == EvictionPolicy::FirstInFirstOut));
+        assert((ordered.peek("B") == nullptr) == (eviction == EvictionPolicy::LeastRecentlyUsed));
+    }
+    // Fewer entries allowed than there are shards still bounds the whole cache.
+    for (std::size_t capacity : {0, 1, 5, 20}) {
+        PlanCache bounded(CacheOptions{capacity, 16, EvictionPolicy::LeastRecentlyUsed});
+        for (int i = 0; i < 40; i++) {
+            bounded.insert(std::to_string(i), std::make_shared<CachedExpression>(cached.buildPlan("42+")));
+            assert(bounded.size() <= capacity);
+        }
+    }
+
+    // Bulk registration is all or nothing.
+    try {
+        cached.define({{'a', [](Lazy a, Lazy) { return a(); }},
+                       {'b', [](Lazy, Lazy b) { return b(); }},
+                       {'a', [](Lazy, Lazy) { return 0; }}});
+        assert(false);
+    }
+    catch (OperatorAlreadyDefined) {
+    }
+    cached.define({{'a', [](Lazy a, Lazy) { return a(); }},
+                   {'b', [](Lazy, Lazy b) { return b(); }}});
+    assert(cached.calculate("42a42bb") == 2);
+
+    cached.define('m', [](Lazy a, Lazy b) {
+        int x = a(), y = b();
+        return x > y ? x : y;
+    }, OperatorFlags::Pure | OperatorFlags::Strict);
+    assert(cached.buildPlan("24m2+")->size() == 1);
+    assert(cached.calculate("24m2+") == 6);
+    assert(cached.buildPlan("42!2m")->size() == 4);
+
+    CalculatorOptions once;
+    once.evaluatePureSubtreesOnce = true;
+    LazyCalculator memoizing(once);
+    int calls = 0;
+    memoizing.define('c', [&calls](Lazy a, Lazy b) {
+        calls++;
+        return a() + b();
+    });
+    // Shared subtrees with effects must still run at every use.
+    assert(memoizing.calculate("42c42c+") == 12);
+    assert(calls == 2);
+
+    // Prepared expressions read their inputs from slots bound at evaluation.
+    int xSlot = memoizing.defineInput('x');
+    int ySlot = memoizing.defineInput('y');
+    assert(xSlot == 0 && ySlot == 1);
+    PreparedExpression affine = memoizing.prepare("x2*y+");
+    assert(affine({4, 2}) == 10);
+    assert(affine({-1, 0}) == -2);
+    const int row[] = {2, 4};
+    assert(affine(row) == 8);
+    // Rebinding a shallow expression evaluates it without touching the heap.
+    std::size_t rebindAllocations = heapAllocations;
+    assert(affine(row) == 8);
+    assert(heapAllocations == rebindAllocations);
+    assert(memoizing.compile("x2*y+")->run(row) == 8);
+    try {
+        memoizing.calculate("x2*");
+        assert(false);
+    }
+    catch (UnboundInput) {
+    }
+    try {
+        memoizing.define('x', [](Lazy a, Lazy) { return a(); });
+        assert(false);
+    }
+    catch (OperatorAlreadyDefined) {
+    }
+    int pureCalls = 0;
+    memoizing.define('q', [&pureCalls](Lazy a, Lazy b) {
+        pureCalls++;
+        return a() - b();
+    }, OperatorFlags::Pure | OperatorFlags::Strict);
+    assert(memoizing.prepare("xyqxyq*")({4, 2}) == 4);
+    assert(pureCalls == 1);
+
+    // Columnar evaluation agrees with row-by-row evaluation on every path.
+    std::vector<int> xs, ys;
+    for (int i = 0; i < 5000; i++) {
+        xs.push_back(i * 7919 % 20011 - 10000);
+        ys.push_back(i % 1000);
+    }
+    const int *columns[] = {xs.data(), ys.data()};
+    for (auto expression: {"xy*x-y2+/", "x2-", "4", "y"}) {
+        PreparedExpression prepared = memoizing.prepare(expression);
+        for (auto isa: {InstructionSet::Scalar, InstructionSet::Avx2, InstructionSet::Avx512}) {
+            ColumnarExpression columnar(prepared, isa);
+            assert(columnar.vectorized());
+            std::vector<int> out(xs.size());
+            columnar.evaluate(columns, xs.size(), out.data());
+            for (std::size_t r = 0; r < xs.size(); r++) {
+                assert(out[r] == prepared({xs[r], ys[r]}));
+            }
+        }
+    }
+    // Chains of an associative operator become one n-ary node on every path.
+    std::string sum = "x";
+    for (int i = 0; i < 1000; i++) {
+        sum += "y+";
+    }
+    std::string rightDeep = std::string(1000, 'x') + std::string(999, '+');
+    assert(memoizing.buildPlan(sum)->size() == 3);
+    assert(memoizing.buildPlan(sum)->depth() == 2);
+    assert(memoizing.buildPlan(rightDeep)->depth() == 2);
+    for (const std::string &expression : {sum, rightDeep}) {
+        PreparedExpression prepared = memoizing.prepare(expression);
+        ColumnarExpression columnar(prepared);
+        assert(columnar.vectorized());
+        std::vector<int> out(xs.size());
+        columnar.evaluate(columns, xs.size(), out.data());
+        auto program = memoizing.compile(expression);
+        NativeExpression compiled(prepared);
+        for (std::size_t r = 0; r < xs.size(); r += 13) {
+            const int values[] = {xs[r], ys[r]};
+            int expected = expression == sum ? xs[r] + 1000 * ys[r] : 1000 * xs[r];
+            assert(prepared(values) == expected && out[r] == expected);
+            assert(program->run(values) == expected && compiled(values) == expected);
+        }
+    }
+    ColumnarExpression rowByRow(memoizing.prepare("xy2+q"));
+    assert(!rowByRow.vectorized());
+    std::vector<int> out(xs.size());
+    rowByRow.evaluate(columns, xs.size(), out.data());
+    assert(out[1234] == xs[1234] - ys[1234] - 2);
+
+#ifdef __unix__
+    // Column files are streamed through memory maps.
+    {
+        char xPath[] = "/tmp/jnp_7_xXXXXXX", yPath[] = "/tmp/jnp_7_yXXXXXX", outPath[] = "/tmp/jnp_7_oXXXXXX";
+        for (char *path : {xPath, yPath, outPath}) {
+            ::close(::mkstemp(path));
+        }
+        std::ofstream(xPath, std::ios::binary).write(reinterpret_cast<const char *>(xs.data()),
+                                                      xs.size() * sizeof(int));
+        std::ofstream(yPath, std::ios::binary).write(reinterpret_cast<const char *>(ys.data()),
+                                                      ys.size() * sizeof(int));
+        evaluateColumnFiles(ColumnarExpression(memoizing.prepare("xy*x-y2+/")), {xPath, yPath}, outPath);
+        std::vector<int> written(xs.size() + 1);
+        std::ifstream result(outPath, std::ios::binary);
+        result.read(reinterpret_cast<char *>(written.data()), written.size() * sizeof(int));
+        assert(static_cast<std::size_t>(result.gcount()) == xs.size() * sizeof(int));
+        assert(written[4321] == (xs[4321] * ys[4321] - xs[4321]) / (ys[4321] + 2));
+        for (const char *path : {xPath, yPath, outPath}) {
+            std::remove(path);
+        }
+    }
+#endif
+
+    // Hot cached expressions are promoted to native code in the background.
+    CalculatorOptions tiered;
+    tiered.promotionThreshold = 3;
+    LazyCalculator promoting(tiered);
+    promoting.define('c', [&calls](Lazy a, Lazy b) {
+        calls++;
+        return a() + b();
+    });
+    assert(promoting.tierOf("22c2*") == ExecutionTier::Uncached);
+    assert(promoting.calculate("22c2*") == 8);
+    assert(promoting.tierOf("22c2*") == ExecutionTier::Interpreted);
+    for (int i = 0; i < 1000 && promoting.tierOf("22c2*") != ExecutionTier::Native; i++) {
+        assert(promoting.calculate("22c2*") == 8);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+#ifdef LAZY_CALCULATOR_JIT
+    assert(promoting.tierOf("22c2*") == ExecutionTier::Native);
+#endif
+    calls = 0;
+    assert(promoting.calculate("22c2*") == 8);
+    assert(calls == 1);
+    // Arithmetic only, which is otherwise streamed past the cache.
+    for (int i = 0; i < 1000 && promoting.tierOf("42+2*") != ExecutionTier::Native; i++) {
+        assert(promoting.calculate("42+2*") == 12);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+#ifdef LAZY_CALCULATOR_JIT
+    assert(promoting.tierOf("42+2*") == ExecutionTier::Native);
+#else
+    assert(promoting.tierOf("42+2*") == ExecutionTier::Interpreted);
+#endif
+    assert(calculator.tierOf("42+2*") == ExecutionTier::Uncached);
+    assert(calculator.calculate("42+2*") == 12);
+    assert(calculator.tierOf("42+2*") == ExecutionTier::Uncached);
+
+    // Native code agrees with the interpreter and calls back into it for user operators.
+    NativeExpression native = memoizing.compileNative("xy*x-y2+/");
+    assert(native.compiled());
+    for (std::size_t r = 0; r < xs.size(); r += 7) {
+        const int values[] = {xs[r], ys[r]};
+        assert(native(values) == memoizing.prepare("xy*x-y2+/")(values));
+    }
+    calls = 0;
+    Lazy mixed = memoizing.compileNative("22c22c+42-*");
+    assert(mixed() == 16);
+    assert(calls == 2);
+    memoizing.define('e', [](Lazy, Lazy) -> int { throw std::runtime_error("e"); });
+    try {
+        memoizing.compileNative("2422e+*")();
+        assert(false);
+    }
+    catch (std::runtime_error &) {
+    }
+    try {
+        memoizing.compileNative("x2+")();
+        assert(false);
+    }
+    catch (UnboundInput) {
+    }
+    // An operator named '\0' is a user operator, not a built-in one.
+    memoizing.define('\0', [](Lazy a, Lazy b) { return a() + b() + 100; });
+    const std::string nul("40\0", 3);
+    assert(memoizing.compileNative(nul)() == memoizing.calculate(nul));
+    assert(memoizing.compileNative(nul)() == 104);
+
+    // Call-by-need operands run once however often the operator reads them.
+    auto square = [](Lazy a, Lazy) { return a() * a(); };
+    memoizing.define('n', square);
+    memoizing.define('s', square, OperatorFlags::CallByNeed);
+    calls = 0;
+    assert(memoizing.calculate("22c2n2n2n") == 4 * 4 * 4 * 4 * 4 * 4 * 4 * 4);
+    assert(calls == 8);
+    calls = 0;
+    assert(memoizing.calculate("22c2s2s2s") == 4 * 4 * 4 * 4 * 4 * 4 * 4 * 4);
+    assert(calls == 1);
+    calls = 0;
+    assert(memoizing.compile("22c2s2s2s")->run() == 4 * 4 * 4 * 4 * 4 * 4 * 4 * 4);
+    assert(calls == 1);
+
+    // Deep chains of strict operators are evaluated without native recursion.
+    memoizing.define('k', [&calls](Lazy a, Lazy b) {
+        int x = a();
+        int y = b();
+        calls++;
+        return x + y;
+    }, OperatorFlags::Strict);
+    std::string deep = "22c";
+    std::string deepStrict = "2";
+    for (int i = 0; i < 300000; i++) {
+        deep += "2+";
+        deepStrict += "2k";
+    }
+    assert(memoizing.calculate(deep) == 4 + 2 * 300000);
+    assert(memoizing.compile(deep)->run() == 4 + 2 * 300000);
+    calls = 0;
+    assert(memoizing.calculate(deepStrict) == 2 + 2 * 300000);
+    assert(memoizing.compile(deepStrict)->run() == 2 + 2 * 300000);
+    assert(calls == 2 * 300000);
+    // Deep chains of other operators nest native calls, on stack segments
+    // from the heap once the thread's own stack runs low.
+    std::string deepLazy = "2";
+    for (int i = 0; i < 100000; i++) {
+        deepLazy += "4,";
+    }
+    assert(calculator.calculate(deepLazy) == 4);
+    assert(calculator.compile(deepLazy)->run() == 4);
+    // Also on a thread that never looked its stack up.
+    int fromThread = 0;
+    std::thread([&]() { fromThread = calculator.calculate(deepLazy); }).join();
+    assert(fromThread == 4);
+#ifdef LAZY_CALCULATOR_STACK_SEGMENTS
+    // Even one whose stack is smaller than the fallback guess.
+    struct SmallStackRun {
+        LazyCalculator *calculator;
+        std::string expression;
+        int result;
+    } smallStack{&calculator, deepLazy.substr(0, 1 + 2 * 20000), 0};
+    pthread_attr_t smallAttributes;
+    pthread_t small;
+    pthread_attr_init(&smallAttributes);
+    pthread_attr_setstacksize(&smallAttributes, std::size_t(1) << 19);
+    int created = pthread_create(&small, &smallAttributes, [](void *argument) -> void * {
+        auto *run = static_cast<SmallStackRun *>(argument);
+        run->result = run->calculator->calculate(run->expression);
+        return nullptr;
+    }, &smallStack);
+    assert(created == 0);
+    pthread_join(small, nullptr);
+    pthread_attr_destroy(&smallAttributes);
+    assert(smallStack.result == 4);
+#endif
+    calculator.define('E', [](Lazy, Lazy) -> int { throw std::runtime_error("E"); });
+    try {
+        calculator.calculate("42E" + deepLazy.substr(1));
+        assert(false);
+    }
+    catch (std::runtime_error &) {
+    }
+    // The check for strictness runs before anything is evaluated.
+    calls = 0;
+    try {
+        memoizing.calculate("22k2k&");
+        assert(false);
+    }
+    catch (UnknownOperator) {
+    }
+    assert(calls == 0);
+
+    // Batches are spread over a work-stealing pool.
+    std::string heavy = "4";
+    for (int i = 0; i < 2000; i++) {
+        heavy += "2a";
+    }
+    std::vector<std::string> batch;
+    for (int i = 0; i < 1000; i++) {
+        batch.push_back(i % 100 == 0 ? heavy : "42m2+");
+    }
+    batch.push_back("42&");
+    std::vector<BatchResult> results = cached.tryCalculateBatch(batch);
+    assert(results[0].value == 4 && results[1].value == 6 && !results[999].error);
+    try {
+        std::rethrow_exception(results[1000].error);
+    }
+    catch (UnknownOperator) {
+    }
+    batch.pop_back();
+    assert(cached.calculateBatch(batch)[500] == 4);
+    const std::string fixedBatch[] = {"42+", "42-", "42m"};
+    std::vector<int> spanned = cached.calculateBatch(fixedBatch);
+    assert(spanned.size() == 3 && spanned[0] == 6 && spanned[1] == 2);
+    assert(!cached.tryCalculateBatch(std::span(batch).first(10))[9].error);
+
+    // Heavy operands of pure strict operators are evaluated concurrently.
+    CalculatorOptions forking;
+    forking.pool = std::make_shared<WorkStealingPool>(4);
+    forking.parallelThreshold = 64;
+    LazyCalculator parallel(forking);
+    parallel.defineInput('x');
+    parallel.define('p', [](Lazy a, Lazy b) { return a() + b(); },
+                    OperatorFlags::Pure | OperatorFlags::Strict | OperatorFlags::Associative | OperatorFlags::Commutative);
+    parallel.define('t', [](Lazy a, Lazy b) -> int {
+        int sum = a() + b();
+        if (sum < 0) {
+            throw std::runtime_error("t");
+        }
+        return sum;
+    }, OperatorFlags::Pure | OperatorFlags::Strict);
+    std::string balanced = "x";
+    std::string throwing = "x";
+    for (int i = 0; i < 16; i++) {
+        balanced = balanced + balanced + "p";
+        throwing = throwing + throwing + "t";
+    }
+    PreparedExpression forked = parallel.prepare(balanced);
+    assert(forked({1}) == 65536);
+    assert(forked({-2}) == -131072);
+    const int three[] = {3};
+    assert(forked(three) == parallel.plan(balanced)->evaluate(three));
+    std::string terms = "x";
+    for (int i = 0; i < 10000; i++) {
+        terms += "x2pp";
+    }
+    assert(parallel.prepare(terms)(three) == 3 + 10000 * 5);
+    try {
+        parallel.prepare(throwing)({-1});
+        assert(false);
+    }
+    catch (std::runtime_error) {
+    }
 
     for (auto bad: {"", "42", "4+", "424+"}) {
         try {